@@ -0,0 +1,649 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "heap.h"
+#include "custom_unistd.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define DEFAULT_OPS 200000
+#define DEFAULT_MIB 256
+#define SLOTS       4096
+
+enum op_t {
+	op_malloc,
+	op_calloc,
+	op_realloc,
+	op_aligned,
+	op_free,
+	op_count
+};
+static const char *op_names[op_count] = { "malloc", "calloc", "realloc", "aligned", "free" };
+
+// Latency of every operation of the running workload, per operation type
+struct samples_t {
+	double *latency[op_count];
+	size_t count[op_count];
+	size_t capacity[op_count];
+	size_t peak_memory;
+	size_t peak_live;
+	double total_ns;
+};
+static struct samples_t samples;
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+static size_t rng_range(size_t low, size_t high) {
+	return low + rng() % (high - low + 1);
+}
+static double now_ns(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e9 + time.tv_nsec;
+}
+static void record(enum op_t op, double start) {
+	double latency = now_ns() - start;
+	if (samples.count[op] == samples.capacity[op]) {
+		samples.capacity[op] = samples.capacity[op] ? samples.capacity[op] * 2 : 1024;
+		samples.latency[op] = realloc(samples.latency[op], samples.capacity[op] * sizeof(double));
+		if (samples.latency[op] == NULL) {
+			fprintf(stderr, "out of memory for samples\n");
+			exit(1);
+		}
+	}
+	samples.latency[op][samples.count[op]++] = latency;
+	samples.total_ns += latency;
+	// THE HEAP AND THE MAPPINGS OF LARGE BLOCKS
+	struct heap_stats_t stats;
+	heap_stats(&stats);
+	if (stats.heap_size + stats.mapped_size > samples.peak_memory) {
+		samples.peak_memory = stats.heap_size + stats.mapped_size;
+	}
+}
+
+// Timed calls, each one is a single sample
+static void *timed_malloc(size_t size) {
+	double start = now_ns();
+	void *block = heap_malloc(size);
+	record(op_malloc, start);
+	return block;
+}
+static void *timed_calloc(size_t number, size_t size) {
+	double start = now_ns();
+	void *block = heap_calloc(number, size);
+	record(op_calloc, start);
+	return block;
+}
+static void *timed_realloc(void *memblock, size_t size) {
+	double start = now_ns();
+	void *block = heap_realloc(memblock, size);
+	record(op_realloc, start);
+	return block;
+}
+static void *timed_realloc_memalign(void *memblock, size_t alignment, size_t size) {
+	double start = now_ns();
+	void *block = heap_realloc_memalign(memblock, alignment, size);
+	record(op_realloc, start);
+	return block;
+}
+static void *timed_memalign(size_t alignment, size_t size) {
+	double start = now_ns();
+	void *block = heap_memalign(alignment, size);
+	record(op_aligned, start);
+	return block;
+}
+static void *timed_malloc_aligned(size_t size) {
+	double start = now_ns();
+	void *block = heap_malloc_aligned(size);
+	record(op_aligned, start);
+	return block;
+}
+static void timed_free(void *block) {
+	double start = now_ns();
+	heap_free(block);
+	record(op_free, start);
+}
+static void touch(void *block, size_t size) {
+	if (block != NULL) {
+		memset(block, 0xA5, size < 64 ? size : 64);
+	}
+}
+static void free_slots(void **slots, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		if (slots[i] != NULL) {
+			timed_free(slots[i]);
+			slots[i] = NULL;
+		}
+	}
+}
+
+// Random small blocks in a fixed set of slots, a block is freed when its slot is picked again
+static void uniform_small(size_t ops) {
+	static void *slots[SLOTS];
+	for (size_t i = 0; i < ops; ++i) {
+		size_t j = rng() % SLOTS;
+		size_t size = rng_range(8, 256);
+		if (slots[j] != NULL) {
+			timed_free(slots[j]);
+			slots[j] = NULL;
+		} else if (rng() % 8 == 0) {
+			slots[j] = timed_calloc(1, size);
+			touch(slots[j], size);
+		} else {
+			slots[j] = timed_malloc(size);
+			touch(slots[j], size);
+		}
+	}
+	free_slots(slots, SLOTS);
+}
+// Every doubling of the size from 16 bytes up to 1 MiB is 45% as likely as the previous one,
+// so most blocks are small with a long tail of large ones
+static size_t power_law_size(void) {
+	size_t size = 16;
+	while (size < 1024 * 1024 && rng() % 100 < 45) {
+		size *= 2;
+	}
+	return size + rng() % size;
+}
+static void power_law(size_t ops) {
+	static void *slots[SLOTS];
+	for (size_t i = 0; i < ops; ++i) {
+		size_t j = rng() % SLOTS;
+		if (slots[j] != NULL) {
+			timed_free(slots[j]);
+			slots[j] = NULL;
+		} else {
+			size_t size = power_law_size();
+			slots[j] = timed_malloc(size);
+			touch(slots[j], size);
+		}
+	}
+	free_slots(slots, SLOTS);
+}
+// Blocks are queued by a producer and freed in the same order by a consumer
+static void producer_consumer(size_t ops) {
+	static void *queue[SLOTS];
+	size_t head = 0;
+	size_t tail = 0;
+	for (size_t i = 0; i < ops; ++i) {
+		int produce = tail - head < SLOTS && (tail - head < SLOTS / 2 || rng() % 2 == 0);
+		if (produce) {
+			size_t size = rng_range(32, 2048);
+			queue[tail % SLOTS] = timed_malloc(size);
+			touch(queue[tail % SLOTS], size);
+			tail++;
+		} else {
+			timed_free(queue[head % SLOTS]);
+			head++;
+		}
+	}
+	while (head != tail) {
+		timed_free(queue[head % SLOTS]);
+		head++;
+	}
+}
+// Buffers growing by small steps up to 64 KiB, as appended to by a string builder
+static void realloc_growth(size_t ops) {
+	static void *slots[64];
+	static size_t sizes[64];
+	for (size_t i = 0; i < ops; ++i) {
+		size_t j = rng() % 64;
+		if (sizes[j] >= 64 * 1024) {
+			timed_free(slots[j]);
+			slots[j] = NULL;
+			sizes[j] = 0;
+			continue;
+		}
+		size_t size = sizes[j] + rng_range(16, 512);
+		void *block = timed_realloc(slots[j], size);
+		if (block != NULL) {
+			sizes[j] = size;
+			slots[j] = block;
+			touch(block, sizes[j]);
+		}
+	}
+	free_slots(slots, 64);
+	memset(sizes, 0, sizeof(sizes));
+}
+// Mostly aligned allocations, from 16 bytes to whole pages
+static void aligned_heavy(size_t ops) {
+	static void *slots[SLOTS];
+	for (size_t i = 0; i < ops; ++i) {
+		size_t j = rng() % SLOTS;
+		size_t size = rng_range(16, 4096);
+		if (slots[j] != NULL) {
+			timed_free(slots[j]);
+			slots[j] = NULL;
+		} else if (rng() % 4 == 0) {
+			slots[j] = timed_malloc_aligned(size);
+			touch(slots[j], size);
+		} else {
+			slots[j] = timed_memalign((size_t)16 << rng() % 8, size);
+			touch(slots[j], size);
+		}
+	}
+	free_slots(slots, SLOTS);
+}
+
+// Counts data TLB misses of the calling thread, -1 when the counter isn't available
+static int tlb_counter_open(void) {
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+static long long tlb_counter_read(int fd) {
+	long long count = -1;
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return -1;
+	}
+	return count;
+}
+// Anonymous memory of the process backed by transparent huge pages
+static long huge_pages_kb(void) {
+	FILE *file = fopen("/proc/self/smaps_rollup", "r");
+	if (file == NULL) {
+		return -1;
+	}
+	char line[256];
+	long kb = -1;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(file);
+	return kb;
+}
+static size_t random_access_size = (size_t)DEFAULT_MIB << 20;
+
+// Reads random words of one large block, from its own mapping or from the heap
+static void random_access_block(const char *name, size_t mmap_threshold, size_t accesses) {
+	struct heap_config_t config;
+	heap_get_config(&config);
+	size_t saved_threshold = config.mmap_threshold;
+	config.mmap_threshold = mmap_threshold;
+	heap_set_config(&config);
+	uint64_t *block = timed_malloc(random_access_size);
+	config.mmap_threshold = saved_threshold;
+	heap_set_config(&config);
+	if (block == NULL) {
+		printf("  %-13s allocation of %zu MiB failed\n", name, random_access_size >> 20);
+		return;
+	}
+	size_t words = random_access_size / sizeof(uint64_t);
+	for (size_t i = 0; i < words; ++i) {
+		block[i] = i;
+	}
+	int fd = tlb_counter_open();
+#ifdef __linux__
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	uint64_t sum = 0;
+	double start = now_ns();
+	for (size_t i = 0; i < accesses; ++i) {
+		sum += block[rng() % words];
+	}
+	double elapsed = now_ns() - start;
+	long long misses = tlb_counter_read(fd);
+	if (fd >= 0) {
+		close(fd);
+	}
+	printf("  %-13s %5zu MiB  %7.2f ns/access  dTLB misses: ", name, random_access_size >> 20, elapsed / accesses);
+	if (misses >= 0) {
+		printf("%lld", misses);
+	} else {
+		printf("n/a");
+	}
+	printf("  huge pages: %ld KiB  (checksum %llu)\n", huge_pages_kb(), (unsigned long long)sum);
+	timed_free(block);
+}
+static void random_access(size_t ops) {
+#ifdef HEAP_HUGE_PAGES
+	printf("  huge pages: on\n");
+#else
+	printf("  huge pages: off\n");
+#endif
+	struct heap_config_t config;
+	heap_get_config(&config);
+	random_access_block("mapped block", config.mmap_threshold > 0 ? config.mmap_threshold : 1, ops * 100);
+	random_access_block("heap block", 0, ops * 100);
+}
+
+// Blocks of a replayed trace, keyed by the address they had when the trace was recorded. Open
+// addressing with linear probing, removal shifts the following entries back
+struct replay_entry_t {
+	uint64_t address;
+	void *block;
+	size_t size;
+};
+struct replay_map_t {
+	struct replay_entry_t *entries;
+	size_t mask;
+};
+static const char *replay_path;
+
+static size_t replay_slot(const struct replay_map_t *map, uint64_t address) {
+	size_t i = (size_t)((address >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+	while (map->entries[i].address != 0 && map->entries[i].address != address) {
+		i = (i + 1) & map->mask;
+	}
+	return i;
+}
+static void replay_remove(struct replay_map_t *map, size_t i) {
+	map->entries[i].address = 0;
+	for (size_t j = (i + 1) & map->mask; map->entries[j].address != 0; j = (j + 1) & map->mask) {
+		struct replay_entry_t entry = map->entries[j];
+		map->entries[j].address = 0;
+		map->entries[replay_slot(map, entry.address)] = entry;
+	}
+}
+// Loads the whole trace so reading it isn't timed, returns the number of records or -1
+static long load_trace(const char *path, struct heap_trace_record_t **records) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return -1;
+	}
+	char magic[8];
+	uint32_t header[2];
+	if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, HEAP_TRACE_MAGIC, sizeof(magic)) != 0 || fread(header, sizeof(header), 1, file) != 1 || header[0] != sizeof(struct heap_trace_record_t)) {
+		fclose(file);
+		return -1;
+	}
+	size_t capacity = 1024;
+	size_t count = 0;
+	*records = malloc(capacity * sizeof(**records));
+	while (*records != NULL && fread(*records + count, sizeof(**records), 1, file) == 1) {
+		if (++count == capacity) {
+			capacity *= 2;
+			struct heap_trace_record_t *grown = realloc(*records, capacity * sizeof(**records));
+			if (grown == NULL) {
+				free(*records);
+			}
+			*records = grown;
+		}
+	}
+	fclose(file);
+	return *records != NULL ? (long)count : -1;
+}
+// Calls of a recorded trace, as fast as possible. Calls that failed when the trace was recorded
+// are skipped
+static void replay(size_t ops) {
+	(void)ops;
+	struct heap_trace_record_t *records;
+	long count = load_trace(replay_path, &records);
+	if (count < 0) {
+		printf("  can't read the trace %s\n", replay_path);
+		return;
+	}
+	struct replay_map_t map;
+	map.mask = 1023;
+	while (map.mask < (size_t)count * 2) {
+		map.mask = map.mask * 2 + 1;
+	}
+	map.entries = calloc(map.mask + 1, sizeof(struct replay_entry_t));
+	if (map.entries == NULL) {
+		free(records);
+		printf("  out of memory for the replay\n");
+		return;
+	}
+	size_t live = 0;
+	for (long r = 0; r < count; ++r) {
+		const struct heap_trace_record_t *trace = &records[r];
+		size_t size = HEAP_TRACE_SIZE(trace);
+		size_t alignment = HEAP_TRACE_ALIGNMENT(trace);
+		void *block = NULL;
+		size_t i;
+		switch (HEAP_TRACE_OP(trace)) {
+			// MALLOC AND CALLOC
+			case trace_malloc:
+			case trace_calloc:
+				if (trace->result == 0) {
+					break;
+				}
+				if (alignment > sizeof(void *)) {
+					block = timed_memalign(alignment, size);
+				} else if (HEAP_TRACE_OP(trace) == trace_calloc) {
+					block = timed_calloc(1, size);
+				} else {
+					block = timed_malloc(size);
+				}
+				if (block != NULL) {
+					touch(block, size);
+					i = replay_slot(&map, trace->result);
+					map.entries[i] = (struct replay_entry_t){ trace->result, block, size };
+					live += size;
+				}
+				break;
+			// REALLOC OF A LIVE BLOCK
+			case trace_realloc:
+				i = replay_slot(&map, trace->address);
+				if (trace->result == 0 || map.entries[i].address == 0) {
+					break;
+				}
+				struct replay_entry_t entry = map.entries[i];
+				if (alignment > sizeof(void *)) {
+					block = timed_realloc_memalign(entry.block, alignment, size);
+				} else {
+					block = timed_realloc(entry.block, size);
+				}
+				if (block != NULL) {
+					touch(block, size);
+					replay_remove(&map, i);
+					i = replay_slot(&map, trace->result);
+					map.entries[i] = (struct replay_entry_t){ trace->result, block, size };
+					live = live - entry.size + size;
+				}
+				break;
+			// FREE OF A LIVE BLOCK
+			case trace_free:
+				i = replay_slot(&map, trace->address);
+				if (map.entries[i].address == 0) {
+					break;
+				}
+				timed_free(map.entries[i].block);
+				live -= map.entries[i].size;
+				replay_remove(&map, i);
+				break;
+		}
+		if (live > samples.peak_live) {
+			samples.peak_live = live;
+		}
+	}
+	// BLOCKS THE TRACE NEVER FREED
+	for (size_t i = 0; i <= map.mask; ++i) {
+		if (map.entries[i].address != 0) {
+			timed_free(map.entries[i].block);
+		}
+	}
+	printf("  %ld records replayed from %s\n", count, replay_path);
+	free(map.entries);
+	free(records);
+}
+
+struct workload_t {
+	const char *name;
+	void (*run)(size_t ops);
+};
+static const struct workload_t workloads[] = {
+	{ "uniform-small", uniform_small },
+	{ "power-law", power_law },
+	{ "producer-consumer", producer_consumer },
+	{ "realloc-growth", realloc_growth },
+	{ "aligned-heavy", aligned_heavy },
+	{ "random-access", random_access }
+};
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static int compare_latency(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+static double percentile(const double *sorted, size_t count, double p) {
+	return sorted[(size_t)(p * (count - 1))];
+}
+static void report(const struct workload_t *workload) {
+	size_t total = 0;
+	for (int op = 0; op < op_count; ++op) {
+		total += samples.count[op];
+	}
+	printf("%-18s %9zu ops  %12.0f ops/s  peak memory: %zu bytes\n", workload->name, total, total / (samples.total_ns * 1e-9), samples.peak_memory);
+	for (int op = 0; op < op_count; ++op) {
+		size_t count = samples.count[op];
+		if (count == 0) {
+			continue;
+		}
+		qsort(samples.latency[op], count, sizeof(double), compare_latency);
+		printf("  %-8s %9zu  p50 %8.0f ns  p99 %8.0f ns  p999 %9.0f ns\n", op_names[op], count, percentile(samples.latency[op], count, 0.5), percentile(samples.latency[op], count, 0.99), percentile(samples.latency[op], count, 0.999));
+	}
+	// FRAGMENTATION, THE SHARE OF THE PEAK HEAP THAT WAS NEVER LIVE DATA AT ONCE
+	if (samples.peak_live > 0 && samples.peak_memory > 0) {
+		printf("  peak live data: %zu bytes  fragmentation: %.1f%%\n", samples.peak_live, 100.0 * (1.0 - (double)samples.peak_live / samples.peak_memory));
+	}
+}
+static int run(const struct workload_t *workload, size_t ops) {
+	if (heap_setup() != 0) {
+		printf("%s: heap_setup failed\n", workload->name);
+		return -1;
+	}
+	for (int op = 0; op < op_count; ++op) {
+		samples.count[op] = 0;
+	}
+	samples.peak_memory = 0;
+	samples.peak_live = 0;
+	samples.total_ns = 0;
+	rng_state = 88172645463325252ULL;
+	workload->run(ops);
+	report(workload);
+	heap_clean();
+	return 0;
+}
+static int parse_validation(const char *name, enum validation_level_t *level) {
+	const char *names[] = { "off", "sampled", "local", "full" };
+	for (int i = 0; i < 4; ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			*level = (enum validation_level_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+static int parse_placement(const char *name, enum heap_placement_t *placement) {
+	const char *names[] = { "segregated", "next-fit", "best-fit" };
+	for (int i = 0; i < 3; ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			*placement = (enum heap_placement_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+static void usage(const char *program) {
+	printf("usage: %s [-n ops] [-m MiB] [-v off|sampled|local|full] [-p segregated|next-fit|best-fit] [-t trace] [-r trace] [workload ...]\n", program);
+	printf("  -t records the calls of the workloads to a trace, -r replays a trace instead of the workloads\n");
+	printf("workloads:");
+	for (size_t i = 0; i < WORKLOAD_COUNT; ++i) {
+		printf(" %s", workloads[i].name);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	size_t ops = DEFAULT_OPS;
+	const char *trace_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:v:p:t:r:h")) != -1) {
+		enum validation_level_t level;
+		struct heap_config_t config;
+		switch (opt) {
+			case 'n':
+				ops = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				random_access_size = strtoul(optarg, NULL, 10) << 20;
+				break;
+			case 'v':
+				if (parse_validation(optarg, &level) != 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				heap_set_validation(level, 0);
+				break;
+			case 'p':
+				heap_get_config(&config);
+				if (parse_placement(optarg, &config.placement) != 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				heap_set_config(&config);
+				break;
+			case 't':
+				trace_path = optarg;
+				break;
+			case 'r':
+				replay_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	// ROOM FOR THE RANDOM ACCESS BLOCK AND THE GROWTH AROUND IT
+	if (custom_sbrk_reserve(random_access_size + (random_access_size >> 1) + ((size_t)64 << 20)) != 0) {
+		printf("can't reserve a heap for %zu MiB\n", random_access_size >> 20);
+		return 1;
+	}
+	if (trace_path != NULL && heap_trace_start(trace_path) != 0) {
+		printf("can't write the trace %s\n", trace_path);
+		return 1;
+	}
+	int status = 0;
+	if (replay_path != NULL) {
+		const struct workload_t replay_workload = { "replay", replay };
+		status |= run(&replay_workload, ops);
+	} else if (optind == argc) {
+		for (size_t i = 0; i < WORKLOAD_COUNT; ++i) {
+			status |= run(&workloads[i], ops);
+		}
+	}
+	for (int i = optind; i < argc; ++i) {
+		size_t w = 0;
+		while (w < WORKLOAD_COUNT && strcmp(workloads[w].name, argv[i]) != 0) {
+			w++;
+		}
+		if (w == WORKLOAD_COUNT) {
+			usage(argv[0]);
+			return 1;
+		}
+		status |= run(&workloads[w], ops);
+	}
+	heap_trace_stop();
+	for (int op = 0; op < op_count; ++op) {
+		free(samples.latency[op]);
+	}
+	return status != 0;
+}
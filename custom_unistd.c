@@ -5,14 +5,25 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 
 #define PAGE_SIZE       4096
 #define PAGE_FENCE      1
-#define PAGES_AVAILABLE 16384
-#define PAGES_TOTAL     (PAGES_AVAILABLE + 2 * PAGE_FENCE)
-
-uint8_t memory[PAGE_SIZE * PAGES_TOTAL] __attribute__((aligned(PAGE_SIZE)));
+// Default size of the artificial heap, another one can be set with custom_sbrk_reserve()
+#ifndef CUSTOM_MEMORY_SIZE
+#define CUSTOM_MEMORY_SIZE (16384 * PAGE_SIZE)
+#endif
+// Reserved memory is made accessible in steps of COMMIT_SIZE bytes as the break moves up. With
+// HEAP_HUGE_PAGES the heap and large mappings start on a huge page and are advised to use them
+#ifdef HEAP_HUGE_PAGES
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define MEMORY_ALIGNMENT HUGE_PAGE_SIZE
+#define COMMIT_SIZE     HUGE_PAGE_SIZE
+#else
+#define MEMORY_ALIGNMENT PAGE_SIZE
+#define COMMIT_SIZE     (64 * 1024)
+#endif
 
 struct memory_fence_t {
 	uint8_t first_page[PAGE_SIZE];
@@ -20,15 +31,22 @@ struct memory_fence_t {
 };
 
 struct mm_struct {
+	uint8_t *memory;
+	size_t length;
 	intptr_t start_brk;
 	intptr_t brk;
+	intptr_t commit;
 	struct memory_fence_t fence;
 	intptr_t start_mmap;
+	size_t mapped;
 } mm;
 
 void __attribute__((constructor)) memory_init(void);
 void __attribute__((destructor)) memory_check(void);
+int custom_sbrk_reserve(size_t size);
 void* custom_sbrk(intptr_t delta);
+void* custom_mmap(size_t length);
+int custom_munmap(void* address, size_t length);
 
 void __attribute__((constructor)) memory_init(void) {
 	setvbuf(stdout, NULL, _IONBF, 0); 
@@ -38,19 +56,17 @@ void __attribute__((constructor)) memory_init(void) {
 			mm.fence.first_page[i] = rand();
 			mm.fence.last_page[i] = rand();
 	}
-	memcpy(memory, mm.fence.first_page, PAGE_SIZE);
-	memcpy(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
-
-	mm.start_brk = (intptr_t)(memory + PAGE_SIZE);
-	mm.brk = (intptr_t)(memory + PAGE_SIZE);
-	mm.start_mmap = (intptr_t)(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE);
-	
-	assert(mm.start_mmap - mm.start_brk == PAGES_AVAILABLE * PAGE_SIZE);
+	int status = custom_sbrk_reserve(CUSTOM_MEMORY_SIZE);
+	assert(status == 0);
+	(void)status;
 } 
 
 void __attribute__((destructor)) memory_check(void) {
-	int first = memcmp(memory, mm.fence.first_page, PAGE_SIZE);
-	int last = memcmp(memory + (PAGE_FENCE + PAGES_AVAILABLE) * PAGE_SIZE, mm.fence.last_page, PAGE_SIZE);
+	if (mm.memory == NULL) {
+		return;
+	}
+	int first = memcmp(mm.memory, mm.fence.first_page, PAGE_SIZE);
+	int last = memcmp((uint8_t*)mm.start_mmap, mm.fence.last_page, PAGE_SIZE);
 	
 	printf("\n### Fence states:\n");
 	printf("    First fence: [%s]\n", first == 0 ? "vaild" : "damaged");
@@ -59,20 +75,116 @@ void __attribute__((destructor)) memory_check(void) {
 	printf("### Summary: \n");
 	printf("    Whole memory space       : %lu bytes\n", mm.start_mmap - mm.start_brk);
 	printf("    Memory reserved by sbrk(): %lu bytes\n", mm.brk - mm.start_brk);
+	printf("    Memory mapped by mmap()  : %lu bytes\n", mm.mapped);
+}
+
+// Maps length bytes so that address + offset is aligned, the excess around it is unmapped again
+static uint8_t *map_aligned(size_t length, size_t offset, size_t alignment, int prot, int flags) {
+	uint8_t *raw = mmap(NULL, length + alignment, prot, flags, -1, 0);
+	if (raw == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *address = (uint8_t*)((((uintptr_t)raw + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - offset);
+	if (address > raw) {
+		munmap(raw, address - raw);
+	}
+	munmap(address + length, alignment - (address - raw));
+	return address;
+}
+
+// The whole region is reserved without access up front, only the fence pages and the memory
+// below the break are ever committed
+int custom_sbrk_reserve(size_t size) {
+	if (mm.brk != mm.start_brk || size < 1 || size > SIZE_MAX / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	size = (size + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1);
+	size_t length = size + 2 * PAGE_FENCE * PAGE_SIZE;
+	uint8_t *memory = map_aligned(length, PAGE_FENCE * PAGE_SIZE, MEMORY_ALIGNMENT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+	if (memory == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	uint8_t *last_page = memory + (PAGE_FENCE * PAGE_SIZE) + size;
+	if (mprotect(memory, PAGE_SIZE, PROT_READ | PROT_WRITE) != 0 || mprotect(last_page, PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+		munmap(memory, length);
+		errno = ENOMEM;
+		return -1;
+	}
+#ifdef HEAP_HUGE_PAGES
+	madvise(memory + PAGE_FENCE * PAGE_SIZE, size, MADV_HUGEPAGE);
+#endif
+	if (mm.memory != NULL) {
+		munmap(mm.memory, mm.length);
+	}
+	memcpy(memory, mm.fence.first_page, PAGE_SIZE);
+	memcpy(last_page, mm.fence.last_page, PAGE_SIZE);
+
+	mm.memory = memory;
+	mm.length = length;
+	mm.start_brk = (intptr_t)(memory + PAGE_SIZE);
+	mm.brk = mm.start_brk;
+	mm.commit = mm.start_brk;
+	mm.start_mmap = (intptr_t)last_page;
+	return 0;
 }
 
 void* custom_sbrk(intptr_t delta) {
 	intptr_t current_brk = mm.brk;
-	if (mm.brk + delta < mm.start_brk) {
+	// BOUNDS ARE COMPARED AS DISTANCES, so no delta wraps the break around
+	if (delta < mm.start_brk - mm.brk) {
 		errno = 0;
 		return (void*)current_brk;
 	}
 
-	if (mm.brk + delta >= mm.start_mmap) {
+	if (delta >= mm.start_mmap - mm.brk) {
 		errno = ENOMEM;
 		return (void*)-1;
 	}
 
+	// COMMIT MORE MEMORY
+	intptr_t commit = ((mm.brk + delta - mm.start_brk + COMMIT_SIZE - 1) & ~(intptr_t)(COMMIT_SIZE - 1)) + mm.start_brk;
+	if (commit > mm.start_mmap) {
+		commit = mm.start_mmap;
+	}
+	if (commit > mm.commit) {
+		if (mprotect((void*)mm.commit, commit - mm.commit, PROT_READ | PROT_WRITE) != 0) {
+			errno = ENOMEM;
+			return (void*)-1;
+		}
+		mm.commit = commit;
+	}
+	// RELEASE MEMORY ABOVE THE BREAK
+	if (commit < mm.commit) {
+		madvise((void*)commit, mm.commit - commit, MADV_DONTNEED);
+		mprotect((void*)commit, mm.commit - commit, PROT_NONE);
+		mm.commit = commit;
+	}
+
 	mm.brk += delta;
 	return (void*)current_brk;
+}
+
+void* custom_mmap(size_t length) {
+	size_t alignment = length >= MEMORY_ALIGNMENT ? MEMORY_ALIGNMENT : PAGE_SIZE;
+	uint8_t *address = map_aligned(length, 0, alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+	if (address == NULL) {
+		return (void*)-1;
+	}
+#ifdef HEAP_HUGE_PAGES
+	if (alignment == HUGE_PAGE_SIZE) {
+		madvise(address, length, MADV_HUGEPAGE);
+	}
+#endif
+	mm.mapped += length;
+	return address;
+}
+
+int custom_munmap(void* address, size_t length) {
+	if (munmap(address, length) != 0) {
+		return -1;
+	}
+	mm.mapped -= length;
+	return 0;
 }
\ No newline at end of file
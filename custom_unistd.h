@@ -3,6 +3,9 @@
 
 #include <unistd.h>
 
+int custom_sbrk_reserve(size_t size);
 void* custom_sbrk(intptr_t delta);
+void* custom_mmap(size_t length);
+int custom_munmap(void* address, size_t length);
 
 #endif
\ No newline at end of file
@@ -1,1992 +1,2357 @@
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "heap.h"
 #include "custom_unistd.h"
 
-#define FEN_SIZE     16
-#define DEFAULT_SIZE 128
-#define PAGE_SIZE    4096
+#ifndef HEAP_FENCE_SIZE
+#define HEAP_FENCE_SIZE 16
+#endif
+#define FEN_SIZE      HEAP_FENCE_SIZE
+#define DEFAULT_SIZE  128
+#define PAGE_SIZE     4096
+#define WORD_SIZE     sizeof(void *)
+#define MIN_FREE_SIZE (2*FEN_SIZE + 1)
+// Larger sizes and alignments are refused up front, so a size plus control blocks, fences and
+// alignment never wraps around. A compact control block, mapped ones included, holds a 32 bit size
+#ifdef HEAP_COMPACT_HEADER
+#define MAX_BLOCK_SIZE UINT32_MAX
+#else
+#define MAX_BLOCK_SIZE (SIZE_MAX / 4)
+#endif
 
+// Fences are handled a word at a time and keep control blocks word aligned
+#if FEN_SIZE < 8 || FEN_SIZE % 8 != 0
+#error "HEAP_FENCE_SIZE has to be a multiple of 8"
+#endif
+
+// CRC32C uses the SSE4.2 or ARMv8 CRC instructions when the target has them
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_CRC32C
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define CRC32C_WORD(crc, word) _mm_crc32_u32(crc, word)
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_WORD(crc, word) __crc32cw(crc, word)
+#else
+// Software fallback, four bits at a time
+static const uint32_t crc32c_nibbles[16] = {
+	0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1, 0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+	0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9, 0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+};
+static uint32_t crc32c_word(uint32_t crc, uint32_t word) {
+	crc ^= word;
+	for (int i = 0; i < 8; ++i) {
+		crc = (crc >> 4) ^ crc32c_nibbles[crc & 0xF];
+	}
+	return crc;
+}
+#define CRC32C_WORD(crc, word) crc32c_word(crc, word)
+#endif
+#endif
+
+// Integrity checks done by every heap call, production builds only check the chunks they touch
+#ifndef HEAP_VALIDATION
+#ifdef NDEBUG
+#define HEAP_VALIDATION validation_local
+#else
+#define HEAP_VALIDATION validation_full
+#endif
+#endif
+#ifndef HEAP_VALIDATION_SAMPLE
+#define HEAP_VALIDATION_SAMPLE 64
+#endif
+
+// A free top chunk growing past the threshold is given back to custom_sbrk, 0 disables trimming
+#ifndef HEAP_TRIM_THRESHOLD
+#define HEAP_TRIM_THRESHOLD (128 * 1024)
+#endif
+// The heap grows by at least HEAP_GROW_MIN bytes or HEAP_GROW_PERCENT of its size, whichever is
+// larger, rounded up to HEAP_GROW_GRANULARITY so the top chunk serves the next requests
+#ifndef HEAP_GROW_MIN
+#define HEAP_GROW_MIN (64 * 1024)
+#endif
+#ifndef HEAP_GROW_PERCENT
+#define HEAP_GROW_PERCENT 25
+#endif
+// Huge pages back the heap and large mappings only when they are whole, so the heap grows in
+// huge pages and mappings of at least one are rounded up to them
+#ifdef HEAP_HUGE_PAGES
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+#ifndef HEAP_GROW_GRANULARITY
+#ifdef HEAP_HUGE_PAGES
+#define HEAP_GROW_GRANULARITY HUGE_PAGE_SIZE
+#else
+#define HEAP_GROW_GRANULARITY PAGE_SIZE
+#endif
+#endif
+// Blocks of at least HEAP_MMAP_THRESHOLD bytes get a mapping of their own, 0 disables them
+#ifndef HEAP_MMAP_THRESHOLD
+#define HEAP_MMAP_THRESHOLD (128 * 1024)
+#endif
+#ifndef HEAP_PLACEMENT
+#define HEAP_PLACEMENT placement_segregated
+#endif
+
+// Free chunks keep their bin links in the first bytes of their unused data area
+struct memory_bin_links_t {
+	struct memory_chunk_t *prev_free;
+	struct memory_chunk_t *next_free;
+};
+#define BIN_LINKS(ptr) ((struct memory_bin_links_t *)((ptr) + 1))
+// Under best fit the same two words are the children of the chunk in the free tree
+struct memory_tree_links_t {
+	struct memory_chunk_t *left;
+	struct memory_chunk_t *right;
+};
+#define TREE_LINKS(ptr) ((struct memory_tree_links_t *)((ptr) + 1))
+
+// A slab is a page aligned block split into objects of one size class, with a bitmap of the
+// free ones in its header instead of a control block and fences per object. Slab data is sized
+// so that slabs allocated back to back stay page aligned. After the header every object has a
+// byte of slack, how much smaller than its class the requested size was
+#define SLAB_SIZE        PAGE_SIZE
+#if HEAP_SLAB_MAX_SIZE > 0 && FEN_SIZE > 1024
+#error "fences above 1024 bytes leave no room in a slab, build with HEAP_SLAB_MAX_SIZE=0"
+#endif
+#define SLAB_DATA_SIZE   (SLAB_SIZE - sizeof(struct memory_chunk_t) - 2*FEN_SIZE)
+#define SLAB_MAP_WORDS   (SLAB_SIZE / SLAB_CLASS / 64)
+#define SLAB_HEADER_SIZE ((sizeof(struct memory_slab_t) + 2*WORD_SIZE - 1) & ~(2*WORD_SIZE - 1))
+struct memory_slab_t {
+	struct memory_slab_t *prev;
+	struct memory_slab_t *next;
+	uint32_t size;
+	uint32_t count;
+	uint32_t used;
+	uint64_t map[SLAB_MAP_WORDS];
+};
+// Marks the control block of a slab
+static const char slab_tag[] = "slab";
+#define SLAB_SLACK(slab)   ((uint8_t *)(slab) + SLAB_HEADER_SIZE)
+#define SLAB_OBJECTS(slab) (SLAB_SLACK(slab) + (((slab)->count + 2*WORD_SIZE - 1) & ~(2*WORD_SIZE - 1)))
+#define SLAB_IS_FREE(slab, i) (((slab)->map[(i) / 64] >> ((i) % 64)) & 1)
+
+// A mapped block keeps its control block and fences right after the mapping header, mappings
+// of the main heap are kept on a list and unmapped as soon as their block is freed. The header
+// starts the page the block's control block is on, and its tag marks it as a live mapping
+struct memory_mapping_t {
+	struct memory_mapping_t *prev;
+	struct memory_mapping_t *next;
+	struct memory_chunk_t *chunk;
+	size_t length;
+	uintptr_t tag;
+};
+#define MAPPING_TAG(mapping) ((uintptr_t)(mapping) ^ (uintptr_t)0x6D617070696E6721ULL)
+// Besides its first page a mapping is found through every multiple of MAPPING_STRIDE it covers
+#define MAPPING_STRIDE (16 * PAGE_SIZE)
+#define MAPPING_HEADER_SIZE ((sizeof(struct memory_mapping_t) + 2*WORD_SIZE - 1) & ~(2*WORD_SIZE - 1))
+
+// Control blocks of the main heap are indexed by page, so a pointer is resolved to its chunk
+// without walking the heap. The index starts with HEAP_INDEX_PAGES pages and grows with the heap
+#ifndef HEAP_INDEX_PAGES
+#define HEAP_INDEX_PAGES 16384
+#endif
+// A word of the summary covers this many pages, the index always has a multiple of them
+#define INDEX_SUMMARY_PAGES (64 * 64)
+
+#ifdef HEAP_THREAD_SAFE
+#if HEAP_SLAB_MAX_SIZE > 0
+#error "the thread cache can't tell slab objects apart, build with HEAP_SLAB_MAX_SIZE=0"
+#endif
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_CLASS    16
+#define TCACHE_CLASSES  (TCACHE_MAX_SIZE / TCACHE_CLASS)
+#define TCACHE_COUNT    32
+#define TCACHE_BATCH    16
+
+// Blocks in a thread cache stay allocated in the heap, the list is threaded through their data
+struct thread_cache_t {
+	void *blocks[TCACHE_CLASSES];
+	unsigned int count[TCACHE_CLASSES];
+	// Freed blocks wait here until their control block is checked under the lock
+	void *pending[TCACHE_BATCH];
+	unsigned int pending_count;
+	unsigned long generation;
+};
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cache_key;
+static __thread struct thread_cache_t thread_cache;
+static unsigned long heap_generation;
+// Size of the main heap for the range check done by heap_free without the lock
+static size_t heap_published_size;
+#define HEAP_LOCK(manager)   pthread_mutex_lock(&(manager)->lock)
+#define HEAP_UNLOCK(manager) pthread_mutex_unlock(&(manager)->lock)
+#else
+#define HEAP_LOCK(manager)
+#define HEAP_UNLOCK(manager)
+#endif
+
+#ifdef HEAP_THREAD_SAFE
+struct memory_manager_t memory_manager = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#else
 struct memory_manager_t memory_manager;
-           
-enum pointer_type_t get_pointer_type(const void* const pointer) {
-	if (pointer != NULL) {
-		// HEAP BROKEN
-		if (heap_validate() != 0) {
-			return pointer_heap_corrupted;
-		}
-		for (struct memory_chunk_t *ptr = memory_manager.first_memory_chunk; ptr != NULL ; ptr = ptr->next) {
-			// PTR IN STRUCT
-			for (size_t i = 0; i < sizeof(struct memory_chunk_t); ++i) {
-				if ((uint8_t *)ptr + i == pointer) {
-					return pointer_control_block;
-				}
-			}
-			if (ptr->free) {
-				// HIDDEN CASES
-				if (ptr->next != NULL) {
-					// HIDDEN CASE #1
-					for (size_t i = 0; i < (size_t)((uint8_t*)ptr->next - (uint8_t*)ptr) - sizeof(struct memory_chunk_t); ++i) {
-						if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + i == pointer) {
-							return pointer_unallocated;
-						}
-					}
-				} else {
-					// HIDDEN CASE #2
-					for (size_t i = 0; i < (uint8_t *)memory_manager.memory_start + memory_manager.memory_size - (uint8_t *)ptr - sizeof(struct memory_chunk_t); ++i) {
-						if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + i == pointer) {
-							return pointer_unallocated;
-						}
-					}
-				}
-			}
-			// NOT FREE CASE
-			else {
-				// PTR IN FENCES
-				for (size_t i = 0; i < FEN_SIZE; ++i) {
-					// LEFT
-					if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + i == pointer) {
-						return pointer_inside_fences;
-					}
-					// RIGHT
-					if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + i + FEN_SIZE + ptr->size == pointer) {
-						return pointer_inside_fences;
-					}
-				}
-				// PTR IN DATA BLOCK
-				for (size_t i = 0; i < ptr->size; ++i) {
-					if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + FEN_SIZE + i == pointer) {
-						if (i == 0) {
-							return pointer_valid;
-						}
-						return pointer_inside_data_block;
-					}
-				}
-				// HIDDEN CASES
-				if (ptr->next != NULL) {
-					// HIDDEN CASE #1
-					for (size_t i = 0; i < (size_t)((uint8_t*)ptr->next - (uint8_t*)ptr) - sizeof(struct memory_chunk_t) - ptr->size - FEN_SIZE*2; ++i) {
-						if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + ptr->size + 2*FEN_SIZE + i == pointer) {
-							return pointer_unallocated;
-						}
-					}
-				} else {
-					// HIDDEN CASE #2
-					for (size_t i = 0; i < (uint8_t *)memory_manager.memory_start + memory_manager.memory_size - (uint8_t *)ptr - sizeof(struct memory_chunk_t) - ptr->size - FEN_SIZE*2; ++i) {
-						if ((uint8_t *)ptr + sizeof(struct memory_chunk_t) + ptr->size + 2*FEN_SIZE + i == pointer) {
-							return pointer_unallocated;
-						}
-					}
-				}
-			}
+#endif
+static enum validation_level_t validation_level = HEAP_VALIDATION;
+static unsigned int validation_sample = HEAP_VALIDATION_SAMPLE;
+static struct heap_config_t heap_config = {
+	.grow_min = HEAP_GROW_MIN,
+	.grow_percent = HEAP_GROW_PERCENT,
+	.grow_granularity = HEAP_GROW_GRANULARITY,
+	.trim_threshold = HEAP_TRIM_THRESHOLD,
+	.mmap_threshold = HEAP_MMAP_THRESHOLD,
+	.placement = HEAP_PLACEMENT
+};
+static struct memory_mapping_t *mappings;
+// Live mappings hashed by page, so an address is checked against them without touching memory
+// that may no longer be mapped. A NULL mapping marks an empty slot
+struct mapping_entry_t {
+	uintptr_t page;
+	struct memory_mapping_t *mapping;
+};
+static struct mapping_entry_t *mapping_table;
+static unsigned int mapping_table_bits;
+static size_t mapping_table_count;
+// Calls to the main heap are recorded here while a trace is running
+static FILE *trace_file;
+static uint64_t trace_start;
+// First control block of every page and a bitmap of the pages that have one, the summary marks
+// the non-empty words of the bitmap. All three share one mapping
+static struct memory_chunk_t **index_chunks;
+static uint64_t *index_map;
+static uint64_t *index_summary;
+static size_t index_pages;
+
+#ifdef HEAP_COMPACT_HEADER
+#define DEBUG_SITES 4096
+// File and line of the debug blocks are interned here and a compact control block only keeps
+// the index of its site. Site 0 means no debug info, site 1 tags slabs
+struct debug_site_t {
+	const char *filename;
+	int fileline;
+};
+static struct debug_site_t debug_sites[DEBUG_SITES] = { { NULL, 0 }, { slab_tag, 0 } };
+
+static unsigned int debug_site_intern(const char *filename, int fileline) {
+	if (filename == NULL) {
+		return 0;
+	}
+	if (filename == slab_tag) {
+		return 1;
+	}
+	size_t hash = (((uintptr_t)filename >> 3) ^ (size_t)fileline * 2654435761u) % (DEBUG_SITES - 2);
+	for (size_t i = 0; i < DEBUG_SITES - 2; ++i) {
+		struct debug_site_t *site = &debug_sites[2 + (hash + i) % (DEBUG_SITES - 2)];
+		if (site->filename == NULL) {
+			site->filename = filename;
+			site->fileline = fileline;
+		}
+		if (site->filename == filename && site->fileline == fileline) {
+			return site - debug_sites;
 		}
 	}
-	return pointer_null;
+	// TABLE FULL, THE DEBUG INFO IS DROPPED
+	return 0;
 }
-int heap_setup(void) {
+static struct memory_chunk_t *chunk_prev(struct memory_chunk_t *ptr) {
+	return ptr->prev ? (struct memory_chunk_t *)((uint8_t *)ptr - ptr->prev) : NULL;
+}
+static struct memory_chunk_t *chunk_next(struct memory_chunk_t *ptr) {
+	return ptr->next ? (struct memory_chunk_t *)((uint8_t *)ptr + ptr->next) : NULL;
+}
+static void chunk_set_prev(struct memory_chunk_t *ptr, struct memory_chunk_t *prev) {
+	ptr->prev = prev ? (uint8_t *)ptr - (uint8_t *)prev : 0;
+}
+static void chunk_set_next(struct memory_chunk_t *ptr, struct memory_chunk_t *next) {
+	ptr->next = next ? (uint8_t *)next - (uint8_t *)ptr : 0;
+}
+static const char *chunk_filename(struct memory_chunk_t *ptr) {
+	return debug_sites[ptr->site].filename;
+}
+static int chunk_fileline(struct memory_chunk_t *ptr) {
+	return debug_sites[ptr->site].fileline;
+}
+static void chunk_set_debug(struct memory_chunk_t *ptr, const char *filename, int fileline) {
+	ptr->site = debug_site_intern(filename, fileline);
+}
+#else
+static struct memory_chunk_t *chunk_prev(struct memory_chunk_t *ptr) {
+	return ptr->prev;
+}
+static struct memory_chunk_t *chunk_next(struct memory_chunk_t *ptr) {
+	return ptr->next;
+}
+static void chunk_set_prev(struct memory_chunk_t *ptr, struct memory_chunk_t *prev) {
+	ptr->prev = prev;
+}
+static void chunk_set_next(struct memory_chunk_t *ptr, struct memory_chunk_t *next) {
+	ptr->next = next;
+}
+static const char *chunk_filename(struct memory_chunk_t *ptr) {
+	return ptr->filename;
+}
+static int chunk_fileline(struct memory_chunk_t *ptr) {
+	return ptr->fileline;
+}
+static void chunk_set_debug(struct memory_chunk_t *ptr, const char *filename, int fileline) {
+	ptr->filename = filename;
+	ptr->fileline = fileline;
+}
+#endif
+
+static int validate_chunks(struct memory_manager_t *manager);
+static void mapping_release(struct memory_mapping_t *mapping);
+
+static void manager_set_size(struct memory_manager_t *manager, size_t memory_size) {
+	manager->memory_size = memory_size;
+	if (memory_size > manager->stats.peak_heap_size) {
+		manager->stats.peak_heap_size = memory_size;
+	}
+#ifdef HEAP_THREAD_SAFE
+	if (manager == &memory_manager) {
+		__atomic_store_n(&heap_published_size, memory_size, __ATOMIC_RELEASE);
+	}
+#endif
+}
+// Moves released bytes out of and used bytes into the used blocks of the heap
+static void stats_use(struct memory_manager_t *manager, size_t released, size_t used) {
+	manager->stats.used_bytes = manager->stats.used_bytes - released + used;
+	if (manager->stats.used_bytes > manager->stats.peak_used_bytes) {
+		manager->stats.peak_used_bytes = manager->stats.used_bytes;
+	}
+}
+static void manager_init(struct memory_manager_t *manager, void *memory_start, size_t memory_size, size_t memory_limit) {
+	memset(&manager->stats, 0, sizeof(manager->stats));
+	manager->chunk_count = 0;
+	memset(manager->free_histogram, 0, sizeof(manager->free_histogram));
+	manager->memory_start = memory_start;
+	manager_set_size(manager, memory_size);
+	manager->memory_limit = memory_limit;
+	manager->first_memory_chunk = NULL;
+	manager->last_memory_chunk = NULL;
+	memset(manager->bins, 0, sizeof(manager->bins));
+	memset(manager->bin_map, 0, sizeof(manager->bin_map));
+	manager->placement = heap_config.placement;
+	manager->free_tree = NULL;
+	manager->free_tree_max = NULL;
+	memset(manager->bin_max, 0, sizeof(manager->bin_max));
+	memset(manager->bin_max_count, 0, sizeof(manager->bin_max_count));
+	manager->rover = NULL;
+	memset(manager->slabs, 0, sizeof(manager->slabs));
+	manager->validation_counter = 0;
+}
+static size_t index_length(size_t pages) {
+	return pages * sizeof(*index_chunks) + pages / 64 * sizeof(*index_map) + pages / INDEX_SUMMARY_PAGES * sizeof(*index_summary);
+}
+// Makes the index cover a main heap of memory_size bytes, keeping what is already indexed. It at
+// least doubles, so the copying adds up to a constant per page of heap
+static int index_reserve(size_t memory_size) {
+	size_t pages = memory_size / PAGE_SIZE + 1;
+	if (pages <= index_pages) {
+		return 0;
+	}
+	size_t grown = index_pages > 0 ? 2 * index_pages : HEAP_INDEX_PAGES;
+	if (pages < grown) {
+		pages = grown;
+	}
+	pages = (pages + INDEX_SUMMARY_PAGES - 1) / INDEX_SUMMARY_PAGES * INDEX_SUMMARY_PAGES;
+	uint8_t *region = custom_mmap(index_length(pages));
+	if (region == (void *) - 1) {
+		return -1;
+	}
+	struct memory_chunk_t **chunks = (struct memory_chunk_t **)region;
+	uint64_t *map = (uint64_t *)(region + pages * sizeof(*chunks));
+	uint64_t *summary = map + pages / 64;
+	if (index_chunks != NULL) {
+		memcpy(chunks, index_chunks, index_pages * sizeof(*chunks));
+		memcpy(map, index_map, index_pages / 64 * sizeof(*map));
+		memcpy(summary, index_summary, index_pages / INDEX_SUMMARY_PAGES * sizeof(*summary));
+		custom_munmap(index_chunks, index_length(index_pages));
+	}
+	index_chunks = chunks;
+	index_map = map;
+	index_summary = summary;
+	index_pages = pages;
+	return 0;
+}
+static int setup_heap(void) {
 	if (memory_manager.memory_start) {
 		return -1;
 	}
-	memory_manager.memory_start = custom_sbrk(0);
-	if (memory_manager.memory_start == (void *) - 1) {
+	void *memory_start = custom_sbrk(0);
+	if (memory_start == (void *) - 1) {
 		return -1;
 	}
-	
+
 	void *request = custom_sbrk(DEFAULT_SIZE);
 	if (request == (void *) - 1) {
 		return -1;
 	}
-	memory_manager.memory_size = DEFAULT_SIZE;
-	memory_manager.first_memory_chunk = NULL;
+	if (index_reserve(DEFAULT_SIZE) != 0) {
+		custom_sbrk(-DEFAULT_SIZE);
+		return -1;
+	}
+	manager_init(&memory_manager, memory_start, DEFAULT_SIZE, 0);
 	return 0;
 }
+int heap_setup(void) {
+	HEAP_LOCK(&memory_manager);
+	int status = setup_heap();
+#ifdef HEAP_THREAD_SAFE
+	// BLOCKS CACHED BY THREADS FOR THE PREVIOUS HEAP ARE DROPPED
+	__atomic_add_fetch(&heap_generation, 1, __ATOMIC_RELEASE);
+#endif
+	HEAP_UNLOCK(&memory_manager);
+	return status;
+}
 void heap_clean(void) {
+	HEAP_LOCK(&memory_manager);
 	if (memory_manager.memory_size >= DEFAULT_SIZE) {
+		while (mappings != NULL) {
+			mapping_release(mappings);
+		}
+		if (mapping_table != NULL) {
+			custom_munmap(mapping_table, sizeof(*mapping_table) << mapping_table_bits);
+			mapping_table = NULL;
+			mapping_table_count = 0;
+		}
+		custom_munmap(index_chunks, index_length(index_pages));
+		index_chunks = NULL;
+		index_map = NULL;
+		index_summary = NULL;
+		index_pages = 0;
 		custom_sbrk(-memory_manager.memory_size);
-		memory_manager.memory_start = NULL;
-		memory_manager.first_memory_chunk = NULL;
+		manager_init(&memory_manager, NULL, 0, 0);
+#ifdef HEAP_THREAD_SAFE
+		__atomic_add_fetch(&heap_generation, 1, __ATOMIC_RELEASE);
+#endif
 	}
+	HEAP_UNLOCK(&memory_manager);
 }
 
-void *heap_malloc(size_t size) {
-	if (memory_manager.memory_start == NULL || size < 1 || heap_validate() > 0) {
-		return NULL;
+// The main heap grows with custom_sbrk, an arena inside the region reserved for it
+static void *heap_sbrk(struct memory_manager_t *manager, intptr_t delta) {
+#ifdef HEAP_COMPACT_HEADER
+	// SIZES AND LINKS OF A COMPACT CONTROL BLOCK ARE 32 BIT
+	if (delta > 0 && (size_t)delta > UINT32_MAX - manager->memory_size) {
+		return (void *) - 1;
+	}
+#endif
+	if (manager->memory_limit == 0) {
+		manager->stats.sbrk_calls++;
+		void *memory = custom_sbrk(delta);
+		// THE INDEX GROWS WITH THE HEAP
+		if (memory != (void *) - 1 && delta > 0 && index_reserve(manager->memory_size + delta) != 0) {
+			custom_sbrk(-delta);
+			return (void *) - 1;
+		}
+		return memory;
 	}
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		uint8_t *ptr_i = (uint8_t *)memory_manager.memory_start;
-		for (size_t i = 0 ; i < memory_manager.memory_size; ++i, ++ptr_i) {
-			// LEFT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				// WORD SIZE COND
-				if ((intptr_t)ptr_i % sizeof(void *) == 0) {
-					// RIGHT COND
-					if (memory_manager.memory_size - i < size + FEN_SIZE) {
-						void *req = custom_sbrk(size + FEN_SIZE - memory_manager.memory_size + i);
-						if (req == (void *) - 1) {
-							return NULL;
-						}
-						memory_manager.memory_size += size + FEN_SIZE - memory_manager.memory_size + i;
-					}
-					struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-					n_chunk->prev = NULL;
-					n_chunk->next = NULL;
-					n_chunk->size = size;
-					n_chunk->free = 0;
-					n_chunk->lrc = calculateLRC(n_chunk);
-					memory_manager.first_memory_chunk = n_chunk;
-					return set_fences(n_chunk + 1, size);
-				}
-			}
+	if (delta > 0 && (size_t)delta > manager->memory_limit - manager->memory_size) {
+		return (void *) - 1;
+	}
+	return (uint8_t *)manager->memory_start + manager->memory_size;
+}
+// Grows the heap by at least missing bytes, asking for the amount set by the growth policy first
+// and falling back to the exact amount when that much memory isn't available. A policy amount
+// that doesn't fit in a size_t is left as it is and fails the sbrk check
+static int heap_extend(struct memory_manager_t *manager, size_t missing) {
+	size_t increment = SIZE_MAX;
+	if (heap_config.grow_percent <= SIZE_MAX / (manager->memory_size / 100 + 1)) {
+		increment = manager->memory_size / 100 * heap_config.grow_percent;
+	}
+	if (increment < heap_config.grow_min) {
+		increment = heap_config.grow_min;
+	}
+	if (increment < missing) {
+		increment = missing;
+	}
+	size_t remainder = increment % heap_config.grow_granularity;
+	if (remainder != 0 && increment <= SIZE_MAX - (heap_config.grow_granularity - remainder)) {
+		increment += heap_config.grow_granularity - remainder;
+	}
+	if (increment > (size_t)INTPTR_MAX || heap_sbrk(manager, increment) == (void *) - 1) {
+		increment = missing;
+		if (increment > (size_t)INTPTR_MAX || heap_sbrk(manager, increment) == (void *) - 1) {
+			return -1;
 		}
+	}
+	manager_set_size(manager, manager->memory_size + increment);
+	return 0;
+}
+static uint8_t *align_up(uint8_t *address, size_t alignment) {
+	return (uint8_t *)(((uintptr_t)address + (alignment - 1)) & ~(uintptr_t)(alignment - 1));
+}
+static uint8_t *chunk_end(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	if (chunk_next(ptr) != NULL) {
+		return (uint8_t *)chunk_next(ptr);
+	}
+	return (uint8_t *)manager->memory_start + manager->memory_size;
+}
+static int heap_contains(struct memory_manager_t *manager, const void *address) {
+	return (uint8_t *)address >= (uint8_t *)manager->memory_start && (uint8_t *)address < (uint8_t *)manager->memory_start + manager->memory_size;
+}
+// Derives the control block straight from a block address, the LRC and the links of both
+// neighbours have to agree with it so foreign and stale pointers are rejected
+static struct memory_chunk_t *chunk_from_pointer(struct memory_manager_t *manager, const void *address) {
+	if (manager->first_memory_chunk == NULL || ((intptr_t)address & (intptr_t)(WORD_SIZE - 1)) != 0) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// WORD SIZE COND
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				if (ptr->size >= size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
+	if ((uint8_t *)address < (uint8_t *)manager->memory_start + sizeof(struct memory_chunk_t) + FEN_SIZE || !heap_contains(manager, address)) {
+		return NULL;
+	}
+	struct memory_chunk_t *ptr = (struct memory_chunk_t *)((uint8_t *)address - FEN_SIZE - sizeof(struct memory_chunk_t));
+	if (ptr->lrc != calculateLRC(ptr) || ptr->free) {
+		return NULL;
+	}
+	// OWNERSHIP CHECK
+	if (chunk_prev(ptr) == NULL ? manager->first_memory_chunk != ptr : !heap_contains(manager, chunk_prev(ptr)) || chunk_prev(ptr) >= ptr || chunk_next(chunk_prev(ptr)) != ptr) {
+		return NULL;
+	}
+	if (chunk_next(ptr) == NULL ? manager->last_memory_chunk != ptr : !heap_contains(manager, chunk_next(ptr)) || chunk_next(ptr) <= ptr || chunk_prev(chunk_next(ptr)) != ptr) {
+		return NULL;
+	}
+	return ptr;
+}
+void heap_get_config(struct heap_config_t *config) {
+	if (config == NULL) {
+		return;
+	}
+	HEAP_LOCK(&memory_manager);
+	*config = heap_config;
+	HEAP_UNLOCK(&memory_manager);
+}
+int heap_set_config(const struct heap_config_t *config) {
+	if (config == NULL || config->grow_granularity < 1 || config->placement > placement_best_fit) {
+		return -1;
+	}
+	HEAP_LOCK(&memory_manager);
+	heap_config = *config;
+	HEAP_UNLOCK(&memory_manager);
+	return 0;
+}
+// Only copies the counters, so it can be polled often without holding the lock for long
+static void manager_stats(struct memory_manager_t *manager, struct heap_stats_t *stats) {
+	HEAP_LOCK(manager);
+	*stats = manager->stats;
+	stats->heap_size = manager->memory_size;
+	stats->used_blocks = manager->chunk_count - stats->free_blocks + stats->mapped_blocks;
+	stats->overhead_bytes = manager->chunk_count * sizeof(struct memory_chunk_t) + (stats->used_blocks - stats->mapped_blocks) * 2*FEN_SIZE + stats->mapped_blocks * (MAPPING_HEADER_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE);
+	HEAP_UNLOCK(manager);
+}
+void heap_stats(struct heap_stats_t *stats) {
+	if (stats != NULL) {
+		manager_stats(&memory_manager, stats);
+	}
+}
+// The largest free chunk is the largest one of the highest non-empty bin, its list is only walked
+// again once all of its largest chunks have left. The free tree tracks its largest chunk
+static size_t largest_free(struct memory_manager_t *manager) {
+	if (manager->placement == placement_best_fit) {
+		return manager->free_tree_max != NULL ? manager->free_tree_max->size : 0;
+	}
+	for (size_t word = BIN_COUNT / 64; word-- > 0;) {
+		if (manager->bin_map[word] != 0) {
+			size_t index = word * 64 + 63 - __builtin_clzll(manager->bin_map[word]);
+			// STALE MAXIMUM
+			if (manager->bin_max_count[index] == 0) {
+				manager->bin_max[index] = 0;
+				for (struct memory_chunk_t *ptr = manager->bins[index]; ptr != NULL; ptr = BIN_LINKS(ptr)->next_free) {
+					if (ptr->size > manager->bin_max[index]) {
+						manager->bin_max[index] = ptr->size;
+						manager->bin_max_count[index] = 0;
 					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
+					manager->bin_max_count[index] += ptr->size == manager->bin_max[index];
 				}
 			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// WORD SIZE COND
-				if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-					// LEFT COND
-					if ((size_t)(ptr_i - (uint8_t *)(ptr + 1)) >= (size_t)((2*FEN_SIZE + 1) + sizeof(struct memory_chunk_t) + FEN_SIZE)) {
-						// RIGHT COND
-						if (ptr->size - i >= size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->lrc = calculateLRC(a_chunk);
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = a_chunk;
-							} else {
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = ptr->next;
-							}
-							n_chunk->lrc = calculateLRC(n_chunk);
-
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1);
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences(n_chunk + 1, size);
-						}
-					}
-				}
+			return manager->bin_max[index];
+		}
+	}
+	return 0;
+}
+static void manager_fragmentation(struct memory_manager_t *manager, struct heap_fragmentation_t *fragmentation) {
+	HEAP_LOCK(manager);
+	fragmentation->free_bytes = manager->stats.free_bytes;
+	fragmentation->free_blocks = manager->stats.free_blocks;
+	fragmentation->largest_free_block = largest_free(manager);
+	fragmentation->external_fragmentation = 0;
+	if (fragmentation->free_bytes > 0) {
+		fragmentation->external_fragmentation = 1.0 - (double)fragmentation->largest_free_block / fragmentation->free_bytes;
+	}
+	memcpy(fragmentation->histogram, manager->free_histogram, sizeof(fragmentation->histogram));
+	HEAP_UNLOCK(manager);
+}
+void heap_get_fragmentation(struct heap_fragmentation_t *fragmentation) {
+	if (fragmentation != NULL) {
+		manager_fragmentation(&memory_manager, fragmentation);
+	}
+}
+void heap_set_trim_threshold(size_t threshold) {
+	HEAP_LOCK(&memory_manager);
+	heap_config.trim_threshold = threshold;
+	HEAP_UNLOCK(&memory_manager);
+}
+void heap_set_validation(enum validation_level_t level, unsigned int sample_rate) {
+	HEAP_LOCK(&memory_manager);
+	validation_level = level;
+	if (sample_rate > 0) {
+		validation_sample = sample_rate;
+	}
+	memory_manager.validation_counter = 0;
+	HEAP_UNLOCK(&memory_manager);
+}
+// Words of the fence are and-ed together, the right fence is usually unaligned
+static int fence_intact(const uint8_t *fence) {
+	uint64_t all = ~(uint64_t)0;
+	for (size_t i = 0; i < FEN_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, fence + i, sizeof(word));
+		all &= word;
+	}
+	return all == ~(uint64_t)0;
+}
+static int chunk_fences_intact(struct memory_chunk_t *ptr) {
+	uint8_t *fence = (uint8_t *)(ptr + 1);
+	return fence_intact(fence) && fence_intact(fence + FEN_SIZE + ptr->size);
+}
+static int chunk_validate(struct memory_chunk_t *ptr) {
+	if (ptr->lrc != calculateLRC(ptr)) {
+		return 3;
+	}
+	if (!ptr->free && !chunk_fences_intact(ptr)) {
+		return 1;
+	}
+	return 0;
+}
+// Check done when entering a heap call, before the touched chunk is known
+static int heap_check(struct memory_manager_t *manager) {
+	switch (validation_level) {
+		case validation_off:
+		case validation_local:
+			return 0;
+		case validation_sampled:
+			if (++manager->validation_counter < validation_sample) {
+				return 0;
 			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// WORD SIZE COND
-		if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				n_chunk->lrc = calculateLRC(n_chunk);
-
-				ptr->next = n_chunk;
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences(n_chunk + 1, size);	
+			manager->validation_counter = 0;
+			return validate_chunks(manager);
+		default:
+			return validate_chunks(manager);
+	}
+}
+// Check of the touched chunk and its physical neighbours for the local validation level
+static int chunk_check(struct memory_chunk_t *ptr) {
+	if (validation_level != validation_local) {
+		return 0;
+	}
+	int status = chunk_validate(ptr);
+	if (status == 0 && chunk_prev(ptr) != NULL) {
+		status = chunk_validate(chunk_prev(ptr));
+	}
+	if (status == 0 && chunk_next(ptr) != NULL) {
+		status = chunk_validate(chunk_next(ptr));
+	}
+	return status;
+}
+static size_t index_page(const void *address) {
+	return ((uint8_t *)address - (uint8_t *)memory_manager.memory_start) / PAGE_SIZE;
+}
+static void index_mark(size_t page, struct memory_chunk_t *ptr) {
+	index_chunks[page] = ptr;
+	if (ptr != NULL) {
+		index_map[page / 64] |= (uint64_t)1 << (page % 64);
+		index_summary[page / 4096] |= (uint64_t)1 << (page / 64 % 64);
+	} else {
+		index_map[page / 64] &= ~((uint64_t)1 << (page % 64));
+		if (index_map[page / 64] == 0) {
+			index_summary[page / 4096] &= ~((uint64_t)1 << (page / 64 % 64));
+		}
+	}
+}
+static void index_insert(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	if (manager != &memory_manager) {
+		return;
+	}
+	size_t page = index_page(ptr);
+	if (index_chunks[page] == NULL || ptr < index_chunks[page]) {
+		index_mark(page, ptr);
+	}
+}
+// Has to run while ptr is still linked
+static void index_remove(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	if (manager != &memory_manager) {
+		return;
+	}
+	size_t page = index_page(ptr);
+	if (index_chunks[page] == ptr) {
+		struct memory_chunk_t *next = chunk_next(ptr);
+		index_mark(page, next != NULL && index_page(next) == page ? next : NULL);
+	}
+}
+// Last page at or before page that holds a control block, index_pages if there is none
+static size_t index_last_page(size_t page) {
+	size_t word = page / 64;
+	uint64_t map = index_map[word] & (~(uint64_t)0 >> (63 - page % 64));
+	while (map == 0) {
+		if (word == 0) {
+			return index_pages;
+		}
+		// PREVIOUS NON-EMPTY WORD
+		word--;
+		uint64_t summary = index_summary[word / 64] & (~(uint64_t)0 >> (63 - word % 64));
+		while (summary == 0) {
+			if (word < 64) {
+				return index_pages;
 			}
+			word = word / 64 * 64 - 1;
+			summary = index_summary[word / 64];
 		}
+		word = word / 64 * 64 + 63 - __builtin_clzll(summary);
+		map = index_map[word];
 	}
-	return NULL;
+	return word * 64 + 63 - __builtin_clzll(map);
 }
-void *heap_malloc_zero(size_t size) {
-	if (memory_manager.memory_start == NULL || size < 1 || heap_validate() > 0) {
+// Chunk of the main heap with the last control block at or before address
+static struct memory_chunk_t *index_find(const void *address) {
+	size_t page = index_last_page(index_page(address));
+	if (page < index_pages && (uint8_t *)index_chunks[page] > (uint8_t *)address) {
+		page = page > 0 ? index_last_page(page - 1) : index_pages;
+	}
+	if (page == index_pages) {
 		return NULL;
 	}
+	struct memory_chunk_t *ptr = index_chunks[page];
+	while (chunk_next(ptr) != NULL && (uint8_t *)chunk_next(ptr) <= (uint8_t *)address) {
+		ptr = chunk_next(ptr);
+	}
+	return ptr;
+}
+static void chunk_link_after(struct memory_manager_t *manager, struct memory_chunk_t *ptr, struct memory_chunk_t *n_chunk) {
+	chunk_set_prev(n_chunk, ptr);
+	chunk_set_next(n_chunk, chunk_next(ptr));
+	if (chunk_next(ptr) != NULL) {
+		chunk_set_prev(chunk_next(ptr), n_chunk);
+		chunk_next(ptr)->lrc = calculateLRC(chunk_next(ptr));
+	} else {
+		manager->last_memory_chunk = n_chunk;
+	}
+	chunk_set_next(ptr, n_chunk);
+	index_insert(manager, n_chunk);
+	manager->chunk_count++;
+}
+static void chunk_unlink(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	index_remove(manager, ptr);
+	manager->chunk_count--;
+	if (manager->rover == ptr) {
+		manager->rover = chunk_prev(ptr);
+	}
+	if (chunk_prev(ptr) != NULL) {
+		chunk_set_next(chunk_prev(ptr), chunk_next(ptr));
+	} else {
+		manager->first_memory_chunk = chunk_next(ptr);
+	}
+	if (chunk_next(ptr) != NULL) {
+		chunk_set_prev(chunk_next(ptr), chunk_prev(ptr));
+		chunk_next(ptr)->lrc = calculateLRC(chunk_next(ptr));
+	} else {
+		manager->last_memory_chunk = chunk_prev(ptr);
+	}
+}
 
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		uint8_t *ptr_i = (uint8_t *)memory_manager.memory_start;
-		for (size_t i = 0 ; i < memory_manager.memory_size; ++i, ++ptr_i) {
-			// LEFT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				// WORD SIZE COND
-				if ((intptr_t)ptr_i % sizeof(void *) == 0) {
-					// RIGHT COND
-					if (memory_manager.memory_size - i < size + FEN_SIZE) {
-						void *req = custom_sbrk(size + FEN_SIZE - memory_manager.memory_size + i);
-						if (req == (void *) - 1) {
-							return NULL;
-						}
-						memory_manager.memory_size += size + FEN_SIZE - memory_manager.memory_size + i;
-					}
-					struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-					n_chunk->prev = NULL;
-					n_chunk->next = NULL;
-					n_chunk->size = size;
-					n_chunk->free = 0;
-					n_chunk->lrc = calculateLRC(n_chunk);
-					memory_manager.first_memory_chunk = n_chunk;
-					return set_fences_fill(n_chunk + 1, size);
-				}
+static enum pointer_type_t classify_slab_pointer(struct memory_slab_t *slab, const uint8_t *pointer) {
+	if (pointer < SLAB_OBJECTS(slab)) {
+		return pointer_control_block;
+	}
+	size_t i = (pointer - SLAB_OBJECTS(slab)) / slab->size;
+	if (i >= slab->count || SLAB_IS_FREE(slab, i)) {
+		return pointer_unallocated;
+	}
+	if ((pointer - SLAB_OBJECTS(slab)) % slab->size == 0) {
+		return pointer_valid;
+	}
+	return pointer_inside_data_block;
+}
+static size_t mapping_slot(uintptr_t page) {
+	return (size_t)((page / PAGE_SIZE * 0x9E3779B97F4A7C15ULL) >> (64 - mapping_table_bits));
+}
+static size_t mapping_table_find(uintptr_t page) {
+	size_t mask = ((size_t)1 << mapping_table_bits) - 1;
+	size_t i = mapping_slot(page);
+	while (mapping_table[i].mapping != NULL && mapping_table[i].page != page) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+static struct memory_mapping_t *mapping_table_get(uintptr_t page) {
+	return mapping_table != NULL ? mapping_table[mapping_table_find(page)].mapping : NULL;
+}
+// A mapping is keyed by its first page and the strides after it
+static uintptr_t mapping_next_key(uintptr_t key) {
+	return (key + MAPPING_STRIDE) & ~(uintptr_t)(MAPPING_STRIDE - 1);
+}
+static size_t mapping_key_count(struct memory_mapping_t *mapping, uintptr_t end) {
+	return 1 + (end - 1) / MAPPING_STRIDE - (uintptr_t)mapping / MAPPING_STRIDE;
+}
+// Keeps the table at most half full, a bigger one is filled from the entries of the old one
+static int mapping_table_insert(struct memory_mapping_t *mapping) {
+	size_t count = mapping_key_count(mapping, (uintptr_t)mapping + mapping->length);
+	unsigned int bits = mapping_table != NULL ? mapping_table_bits : 8;
+	while ((mapping_table_count + count) * 2 > (size_t)1 << bits) {
+		bits++;
+	}
+	if (mapping_table == NULL || bits != mapping_table_bits) {
+		struct mapping_entry_t *table = custom_mmap(sizeof(*table) << bits);
+		if (table == (void *) - 1) {
+			return -1;
+		}
+		struct mapping_entry_t *old = mapping_table;
+		size_t old_size = old != NULL ? (size_t)1 << mapping_table_bits : 0;
+		mapping_table = table;
+		mapping_table_bits = bits;
+		for (size_t i = 0; i < old_size; ++i) {
+			if (old[i].mapping != NULL) {
+				mapping_table[mapping_table_find(old[i].page)] = old[i];
 			}
 		}
+		if (old != NULL) {
+			custom_munmap(old, sizeof(*old) * old_size);
+		}
+	}
+	for (uintptr_t key = (uintptr_t)mapping; key < (uintptr_t)mapping + mapping->length; key = mapping_next_key(key)) {
+		struct mapping_entry_t *entry = &mapping_table[mapping_table_find(key)];
+		entry->page = key;
+		entry->mapping = mapping;
+	}
+	mapping_table_count += count;
+	return 0;
+}
+// Removes the keys of the mapping from offset on. Entries following a removed one are moved back
+// so no probe sequence is broken
+static void mapping_table_remove(struct memory_mapping_t *mapping, size_t offset) {
+	size_t mask = ((size_t)1 << mapping_table_bits) - 1;
+	for (uintptr_t key = (uintptr_t)mapping; key < (uintptr_t)mapping + mapping->length; key = mapping_next_key(key)) {
+		if (key < (uintptr_t)mapping + offset) {
+			continue;
+		}
+		size_t i = mapping_table_find(key);
+		mapping_table[i].mapping = NULL;
+		mapping_table_count--;
+		for (size_t j = (i + 1) & mask; mapping_table[j].mapping != NULL; j = (j + 1) & mask) {
+			struct mapping_entry_t moved = mapping_table[j];
+			mapping_table[j].mapping = NULL;
+			mapping_table[mapping_table_find(moved.page)] = moved;
+		}
+	}
+}
+// Mapping holding any address. One covering the stride below the address is found there, any
+// other one has to start between that stride and the address
+static struct memory_mapping_t *mapping_containing(const void *address) {
+	if (mapping_table_count == 0) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// WORD SIZE COND
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				if (ptr->size >= size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// WORD SIZE COND
-				if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-					// LEFT COND
-					if ((size_t)(ptr_i - (uint8_t *)(ptr + 1)) >= (size_t)((2*FEN_SIZE + 1) + sizeof(struct memory_chunk_t) + FEN_SIZE)) {
-						// RIGHT COND
-						if (ptr->size - i >= size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->lrc = calculateLRC(a_chunk);
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = a_chunk;
-
-							} else {
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = ptr->next;
-							}
-							n_chunk->lrc = calculateLRC(n_chunk);
-
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1);
-							ptr->lrc = calculateLRC(ptr);
+	uintptr_t stride = (uintptr_t)address & ~(uintptr_t)(MAPPING_STRIDE - 1);
+	for (uintptr_t page = (uintptr_t)address & ~(uintptr_t)(PAGE_SIZE - 1); ; page -= PAGE_SIZE) {
+		struct memory_mapping_t *mapping = mapping_table_get(page);
+		if (mapping != NULL) {
+			return (uint8_t *)address < (uint8_t *)mapping + mapping->length ? mapping : NULL;
+		}
+		if (page == stride) {
+			return NULL;
+		}
+	}
+}
+// Mapping of a block address returned by mapping_alloc, only mappings of the main heap exist.
+// Heap addresses are never looked up, any other one is resolved to the start of the page its
+// control block would be on, which has to be a live mapping carrying its tag
+static struct memory_mapping_t *mapping_from_pointer(struct memory_manager_t *manager, const void *address) {
+	size_t offset = MAPPING_HEADER_SIZE + sizeof(struct memory_chunk_t) + FEN_SIZE;
+	if (manager != &memory_manager || mappings == NULL || heap_contains(manager, address) || (uintptr_t)address < offset || ((intptr_t)address & (intptr_t)(WORD_SIZE - 1)) != 0) {
+		return NULL;
+	}
+	struct memory_mapping_t *mapping = (struct memory_mapping_t *)(((uintptr_t)address - offset) & ~(uintptr_t)(PAGE_SIZE - 1));
+	if (mapping_table_get((uintptr_t)mapping) != mapping || mapping->tag != MAPPING_TAG(mapping) || (uint8_t *)(mapping->chunk + 1) + FEN_SIZE != (uint8_t *)address) {
+		return NULL;
+	}
+	return mapping;
+}
+static enum pointer_type_t classify_pointer(const void* const pointer) {
+	if (pointer == NULL) {
+		return pointer_null;
+	}
+	// HEAP BROKEN
+	if (memory_manager.memory_start == NULL || heap_check(&memory_manager) > 0) {
+		return pointer_heap_corrupted;
+	}
+	struct memory_chunk_t *ptr = NULL;
+	if (heap_contains(&memory_manager, pointer)) {
+		ptr = index_find(pointer);
+	} else {
+		struct memory_mapping_t *mapping = mapping_containing(pointer);
+		// PTR IN MAPPING HEADER
+		if (mapping != NULL && (uint8_t *)pointer < (uint8_t *)mapping->chunk) {
+			return pointer_control_block;
+		}
+		ptr = mapping != NULL ? mapping->chunk : NULL;
+	}
+	if (ptr == NULL) {
+		return pointer_null;
+	}
+	if (chunk_check(ptr) > 0) {
+		return pointer_heap_corrupted;
+	}
+	const uint8_t *address = pointer;
+	uint8_t *data = (uint8_t *)(ptr + 1) + FEN_SIZE;
+	// PTR IN STRUCT
+	if (address < (uint8_t *)(ptr + 1)) {
+		return pointer_control_block;
+	}
+	// HIDDEN CASES
+	if (ptr->free || address >= data + ptr->size + FEN_SIZE) {
+		return pointer_unallocated;
+	}
+	// PTR IN FENCES
+	if (address < data || address >= data + ptr->size) {
+		return pointer_inside_fences;
+	}
+	// PTR IN SLAB
+	if (chunk_filename(ptr) == slab_tag) {
+		return classify_slab_pointer((struct memory_slab_t *)data, address);
+	}
+	// PTR IN DATA BLOCK
+	if (address == data) {
+		return pointer_valid;
+	}
+	return pointer_inside_data_block;
+}
+enum pointer_type_t get_pointer_type(const void* const pointer) {
+	HEAP_LOCK(&memory_manager);
+	enum pointer_type_t type = classify_pointer(pointer);
+	HEAP_UNLOCK(&memory_manager);
+	return type;
+}
 
-							return set_fences_fill(n_chunk + 1, size);
-						}
-					}
+// SIZE CLASSES: four bins per power of two, starting at 32 bytes
+static size_t bin_index(size_t size) {
+	if (size < 32) {
+		return 0;
+	}
+	size_t log = 63 - __builtin_clzll(size);
+	size_t index = (log - 5) * 4 + ((size >> (log - 2)) & 3);
+	return index < BIN_COUNT ? index : BIN_COUNT - 1;
+}
+static size_t free_class(size_t size) {
+	size_t log = 63 - __builtin_clzll(size | 1);
+	return log < HEAP_FREE_CLASSES ? log : HEAP_FREE_CLASSES - 1;
+}
+// Orders free chunks by size, then by address
+static int tree_compare(size_t size, const struct memory_chunk_t *address, const struct memory_chunk_t *ptr) {
+	if (size != ptr->size) {
+		return size < ptr->size ? -1 : 1;
+	}
+	return (address > ptr) - (address < ptr);
+}
+// Top-down splay of the free tree, the chunk closest to the key ends up at the root. Needs no
+// parent links, so a tree node fits in the space of the bin links
+static struct memory_chunk_t *tree_splay(struct memory_chunk_t *root, size_t size, const struct memory_chunk_t *address) {
+	if (root == NULL) {
+		return NULL;
+	}
+	struct memory_tree_links_t header = { NULL, NULL };
+	struct memory_tree_links_t *left = &header;
+	struct memory_tree_links_t *right = &header;
+	for (;;) {
+		int order = tree_compare(size, address, root);
+		if (order < 0) {
+			struct memory_chunk_t *child = TREE_LINKS(root)->left;
+			if (child == NULL) {
+				break;
+			}
+			// ROTATE RIGHT
+			if (tree_compare(size, address, child) < 0) {
+				TREE_LINKS(root)->left = TREE_LINKS(child)->right;
+				TREE_LINKS(child)->right = root;
+				root = child;
+				if (TREE_LINKS(root)->left == NULL) {
+					break;
 				}
 			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// WORD SIZE COND
-		if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
+			right->left = root;
+			right = TREE_LINKS(root);
+			root = TREE_LINKS(root)->left;
+		} else if (order > 0) {
+			struct memory_chunk_t *child = TREE_LINKS(root)->right;
+			if (child == NULL) {
+				break;
+			}
+			// ROTATE LEFT
+			if (tree_compare(size, address, child) > 0) {
+				TREE_LINKS(root)->right = TREE_LINKS(child)->left;
+				TREE_LINKS(child)->left = root;
+				root = child;
+				if (TREE_LINKS(root)->right == NULL) {
+					break;
 				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				n_chunk->lrc = calculateLRC(n_chunk);
-
-				ptr->next = n_chunk;
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences_fill(n_chunk + 1, size);	
 			}
+			left->right = root;
+			left = TREE_LINKS(root);
+			root = TREE_LINKS(root)->right;
+		} else {
+			break;
 		}
 	}
-	return NULL;
+	left->right = TREE_LINKS(root)->left;
+	right->left = TREE_LINKS(root)->right;
+	TREE_LINKS(root)->left = header.right;
+	TREE_LINKS(root)->right = header.left;
+	return root;
 }
-void* heap_calloc(size_t number, size_t size) {
-	if (memory_manager.memory_start == NULL || size < 1 || number < 1 || heap_validate() > 0) {
-		return NULL;
+static void tree_insert(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	struct memory_chunk_t *root = tree_splay(manager->free_tree, ptr->size, ptr);
+	if (manager->free_tree_max == NULL || tree_compare(ptr->size, ptr, manager->free_tree_max) > 0) {
+		manager->free_tree_max = ptr;
+	}
+	TREE_LINKS(ptr)->left = NULL;
+	TREE_LINKS(ptr)->right = NULL;
+	if (root != NULL && tree_compare(ptr->size, ptr, root) < 0) {
+		TREE_LINKS(ptr)->left = TREE_LINKS(root)->left;
+		TREE_LINKS(ptr)->right = root;
+		TREE_LINKS(root)->left = NULL;
+	} else if (root != NULL) {
+		TREE_LINKS(ptr)->right = TREE_LINKS(root)->right;
+		TREE_LINKS(ptr)->left = root;
+		TREE_LINKS(root)->right = NULL;
+	}
+	manager->free_tree = ptr;
+}
+static void tree_remove(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	struct memory_chunk_t *root = tree_splay(manager->free_tree, ptr->size, ptr);
+	// THE LARGEST CHUNK ON THE LEFT BECOMES THE ROOT AND TAKES THE RIGHT SUBTREE
+	if (TREE_LINKS(root)->left == NULL) {
+		manager->free_tree = TREE_LINKS(root)->right;
+	} else {
+		manager->free_tree = tree_splay(TREE_LINKS(root)->left, ptr->size, ptr);
+		TREE_LINKS(manager->free_tree)->right = TREE_LINKS(root)->right;
+	}
+	// THE LARGEST CHUNK HAS NOTHING ON ITS RIGHT, SO ITS PREDECESSOR IS THE NEW ROOT
+	if (manager->free_tree_max == ptr) {
+		manager->free_tree_max = manager->free_tree;
 	}
-	return heap_malloc_zero(number*size);
 }
-void* heap_realloc(void* memblock, size_t size) {
-	if (memory_manager.memory_start == NULL || heap_validate() > 0) {
-		return NULL;
+// Smallest free chunk ordered at or after the key
+static struct memory_chunk_t *tree_lower_bound(struct memory_manager_t *manager, size_t size, const struct memory_chunk_t *address) {
+	struct memory_chunk_t *root = tree_splay(manager->free_tree, size, address);
+	manager->free_tree = root;
+	if (root == NULL || tree_compare(size, address, root) <= 0) {
+		return root;
+	}
+	struct memory_chunk_t *ptr = TREE_LINKS(root)->right;
+	while (ptr != NULL && TREE_LINKS(ptr)->left != NULL) {
+		ptr = TREE_LINKS(ptr)->left;
+	}
+	return ptr;
+}
+static void bin_insert(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	manager->stats.free_blocks++;
+	manager->stats.free_bytes += ptr->size;
+	manager->free_histogram[free_class(ptr->size)]++;
+	if (manager->placement == placement_best_fit) {
+		tree_insert(manager, ptr);
+		return;
 	}
-	if (memblock == NULL) {
-		return heap_malloc(size);
+	size_t index = bin_index(ptr->size);
+	if (manager->bins[index] == NULL) {
+		manager->bin_max[index] = ptr->size;
+		manager->bin_max_count[index] = 1;
+	} else if (manager->bin_max_count[index] > 0 && ptr->size >= manager->bin_max[index]) {
+		manager->bin_max_count[index] = ptr->size > manager->bin_max[index] ? 1 : manager->bin_max_count[index] + 1;
+		manager->bin_max[index] = ptr->size;
+	}
+	struct memory_bin_links_t *links = BIN_LINKS(ptr);
+	links->prev_free = NULL;
+	links->next_free = manager->bins[index];
+	if (links->next_free != NULL) {
+		BIN_LINKS(links->next_free)->prev_free = ptr;
+	}
+	manager->bins[index] = ptr;
+	manager->bin_map[index / 64] |= (uint64_t)1 << (index % 64);
+}
+static void bin_remove(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	manager->stats.free_blocks--;
+	manager->stats.free_bytes -= ptr->size;
+	manager->free_histogram[free_class(ptr->size)]--;
+	if (manager->placement == placement_best_fit) {
+		tree_remove(manager, ptr);
+		return;
 	}
-	if (size == 0) {
-		heap_free(memblock);
+	size_t index = bin_index(ptr->size);
+	if (manager->bin_max_count[index] > 0 && ptr->size == manager->bin_max[index]) {
+		manager->bin_max_count[index]--;
+	}
+	struct memory_bin_links_t *links = BIN_LINKS(ptr);
+	if (links->prev_free != NULL) {
+		BIN_LINKS(links->prev_free)->next_free = links->next_free;
+	} else {
+		manager->bins[index] = links->next_free;
+	}
+	if (links->next_free != NULL) {
+		BIN_LINKS(links->next_free)->prev_free = links->prev_free;
+	}
+	if (manager->bins[index] == NULL) {
+		manager->bin_map[index / 64] &= ~((uint64_t)1 << (index % 64));
+	}
+}
+
+// Offset from the end of the control block to the first data address with the requested
+// alignment. When the chunk follows a used block (shift) a gap too small for a free chunk is
+// handed to that block's hidden space, otherwise a free chunk is left in front of the block
+static size_t chunk_data_offset(struct memory_chunk_t *ptr, size_t alignment, int shift) {
+	uint8_t *start = (uint8_t *)(ptr + 1);
+	// AT CHUNK START
+	if (((intptr_t)(start + FEN_SIZE) & (intptr_t)(alignment - 1)) == 0) {
+		return FEN_SIZE;
+	}
+	// SHIFT CASE
+	if (shift) {
+		return align_up(start + FEN_SIZE, alignment) - start;
+	}
+	// SPLIT CASE NEXT BLOCK
+	return align_up(start + MIN_FREE_SIZE + sizeof(struct memory_chunk_t) + FEN_SIZE, alignment) - start;
+}
+static uint8_t *chunk_placement(struct memory_chunk_t *ptr, size_t size, size_t alignment) {
+	size_t offset = chunk_data_offset(ptr, alignment, chunk_prev(ptr) != NULL);
+	if (offset + size + FEN_SIZE > ptr->size) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(ptr != NULL) {
-		if (memblock == (void *)((uint8_t *)(ptr + 1) + FEN_SIZE)) {
-			// FREE BLOCK PTR
-			if (ptr->free == 1) {
-				return NULL;
-			}
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				size_t real_sum = ptr->size;
-				if (ptr->next != NULL) {
-					real_sum = (uint8_t *)ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t) - 2*FEN_SIZE;
-				}
-				// FITS
-				if (real_sum >= size) {
-					if (real_sum - size >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = real_sum - size - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-							ptr->next = a_chunk;
-						}
-					}
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size - real_sum);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size - real_sum;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// IF NEXT IS FREE
-				if (ptr->next != NULL && ptr->next->free == 1) {
-					size_t right_size = ptr->next->size;
-					if (ptr->next->next != NULL) {
-						right_size = (uint8_t *)ptr->next->next - (uint8_t *)ptr->next;
-					}
-					// IF IT HAS THE SPACE
-					if (right_size + real_sum >= size) {
-						if (ptr->next->next != NULL) {
-							ptr->next->next->prev = ptr;
-							ptr->next->next->lrc = calculateLRC(ptr->next->next);
-						}
-						ptr->next = ptr->next->next;
-						ptr->size = size;
-						ptr->lrc = calculateLRC(ptr);
-						return set_fences(ptr + 1, size);
-					}
+	return (uint8_t *)(ptr + 1) + offset;
+}
+static struct memory_chunk_t *bin_find(struct memory_manager_t *manager, size_t size, size_t alignment, uint8_t **data) {
+	size_t index = bin_index(size + 2*FEN_SIZE);
+	for (size_t word = index / 64; word < BIN_COUNT / 64; ++word) {
+		uint64_t map = manager->bin_map[word];
+		if (word == index / 64) {
+			map &= ~(uint64_t)0 << (index % 64);
+		}
+		while (map) {
+			struct memory_chunk_t *ptr = manager->bins[word * 64 + __builtin_ctzll(map)];
+			for (; ptr != NULL; ptr = BIN_LINKS(ptr)->next_free) {
+				*data = chunk_placement(ptr, size, alignment);
+				if (*data != NULL) {
+					return ptr;
 				}
 			}
-			// ADD NEW BLOCK CASE
-			uint8_t *req = heap_malloc(size);
-			if (req == NULL) {
-				return NULL;
+			map &= map - 1;
+		}
+	}
+	return NULL;
+}
+// Walks the chunks from the rover, wrapping around to the first one
+static struct memory_chunk_t *next_fit_find(struct memory_manager_t *manager, size_t size, size_t alignment, uint8_t **data) {
+	struct memory_chunk_t *start = manager->rover != NULL ? manager->rover : manager->first_memory_chunk;
+	struct memory_chunk_t *ptr = start;
+	while (ptr != NULL) {
+		if (ptr->free) {
+			*data = chunk_placement(ptr, size, alignment);
+			if (*data != NULL) {
+				manager->rover = ptr;
+				return ptr;
 			}
-			memcpy(req, memblock, ptr->size);
-			heap_free(memblock);
-			return req;
 		}
-		ptr = ptr->next;
+		ptr = chunk_next(ptr) != NULL ? chunk_next(ptr) : manager->first_memory_chunk;
+		if (ptr == start) {
+			break;
+		}
 	}
-	// INVAID PTR
 	return NULL;
 }
-size_t heap_get_largest_used_block_size(void) {
-	if (memory_manager.memory_start == NULL || heap_validate()) {
-		return 0;
+// Chunks no smaller than the block with its fences are tried in order, so the first one the
+// aligned block fits in is the best one
+static struct memory_chunk_t *best_fit_find(struct memory_manager_t *manager, size_t size, size_t alignment, uint8_t **data) {
+	struct memory_chunk_t *ptr = tree_lower_bound(manager, size + 2*FEN_SIZE, NULL);
+	while (ptr != NULL) {
+		*data = chunk_placement(ptr, size, alignment);
+		if (*data != NULL) {
+			return ptr;
+		}
+		ptr = tree_lower_bound(manager, ptr->size, ptr + 1);
 	}
-	size_t max = 0;
-	struct memory_chunk_t *ptr = memory_manager.first_memory_chunk;
-	if (ptr == NULL) {
-		return 0;
+	return NULL;
+}
+static struct memory_chunk_t *free_find(struct memory_manager_t *manager, size_t size, size_t alignment, uint8_t **data) {
+	switch (manager->placement) {
+		case placement_next_fit:
+			return next_fit_find(manager, size, alignment, data);
+		case placement_best_fit:
+			return best_fit_find(manager, size, alignment, data);
+		default:
+			return bin_find(manager, size, alignment, data);
+	}
+}
+// Merges the free chunk ptr with its free physical neighbours and files the result in its bin
+static struct memory_chunk_t *chunk_coalesce(struct memory_manager_t *manager, struct memory_chunk_t *ptr) {
+	// MERGE NEXT
+	if (chunk_next(ptr) != NULL && chunk_next(ptr)->free) {
+		bin_remove(manager, chunk_next(ptr));
+		chunk_unlink(manager, chunk_next(ptr));
+	}
+	// MERGE PREV
+	if (chunk_prev(ptr) != NULL && chunk_prev(ptr)->free) {
+		struct memory_chunk_t *prev = chunk_prev(ptr);
+		bin_remove(manager, prev);
+		chunk_unlink(manager, ptr);
+		ptr = prev;
+	}
+	ptr->size = chunk_end(manager, ptr) - (uint8_t *)(ptr + 1);
+	ptr->lrc = calculateLRC(ptr);
+	bin_insert(manager, ptr);
+	return ptr;
+}
+// Turns the space between used_end and the next chunk into a free chunk if it is big enough
+static void chunk_split_tail(struct memory_manager_t *manager, struct memory_chunk_t *ptr, uint8_t *used_end) {
+	struct memory_chunk_t *a_chunk = (struct memory_chunk_t *)align_up(used_end, WORD_SIZE);
+	uint8_t *end = chunk_end(manager, ptr);
+	// ADD BLOCK COND
+	if ((uint8_t *)a_chunk + sizeof(struct memory_chunk_t) + MIN_FREE_SIZE <= end) {
+		chunk_link_after(manager, ptr, a_chunk);
+		a_chunk->free = 1;
+		chunk_set_debug(a_chunk, NULL, 0);
+		chunk_coalesce(manager, a_chunk);
 	}
-	while(ptr != NULL) {
-		if (!ptr->free && ptr->size > max) {
-			max = ptr->size;
+}
+// Makes sure the last chunk is free and big enough to hold the block, requesting memory from sbrk
+static struct memory_chunk_t *heap_grow(struct memory_manager_t *manager, size_t size, size_t alignment) {
+	struct memory_chunk_t *last = manager->last_memory_chunk;
+	uint8_t *memory_end = (uint8_t *)manager->memory_start + manager->memory_size;
+	struct memory_chunk_t *top = last;
+	if (last == NULL) {
+		top = (struct memory_chunk_t *)manager->memory_start;
+	} else if (!last->free) {
+		top = (struct memory_chunk_t *)align_up((uint8_t *)(last + 1) + 2*FEN_SIZE + last->size, WORD_SIZE);
+	}
+	int shift = top == last ? chunk_prev(last) != NULL : last != NULL;
+	uint8_t *required_end = (uint8_t *)(top + 1) + chunk_data_offset(top, alignment, shift) + size + FEN_SIZE;
+	if (required_end > memory_end) {
+		if (heap_extend(manager, required_end - memory_end) != 0) {
+			return NULL;
+		}
+		memory_end = (uint8_t *)manager->memory_start + manager->memory_size;
+	}
+	if (top == last) {
+		bin_remove(manager, top);
+	} else {
+		top->free = 1;
+		chunk_set_debug(top, NULL, 0);
+		if (last == NULL) {
+			chunk_set_prev(top, NULL);
+			chunk_set_next(top, NULL);
+			manager->first_memory_chunk = top;
+			manager->last_memory_chunk = top;
+			index_insert(manager, top);
+			manager->chunk_count++;
+		} else {
+			chunk_link_after(manager, last, top);
+			last->lrc = calculateLRC(last);
 		}
-		ptr = ptr->next;
 	}
-	return max;
+	top->size = memory_end - (uint8_t *)(top + 1);
+	top->lrc = calculateLRC(top);
+	bin_insert(manager, top);
+	return top;
 }
-void *set_fences(void *address, size_t size) {
-	if (address == NULL || size < 1) {
-		return NULL;
+// Places a block at data inside the free chunk ptr, which is in no bin, splitting off the free
+// space around it. Only control blocks are written, the data area is left as it is
+static struct memory_chunk_t *chunk_place(struct memory_manager_t *manager, struct memory_chunk_t *ptr, uint8_t *data, size_t size, int fileline, const char *filename) {
+	struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(data - FEN_SIZE - sizeof(struct memory_chunk_t));
+	// SHIFT CASE
+	if (n_chunk != ptr && (uint8_t *)n_chunk - (uint8_t *)(ptr + 1) < MIN_FREE_SIZE) {
+		struct memory_chunk_t *prev = chunk_prev(ptr);
+		struct memory_chunk_t *next = chunk_next(ptr);
+		index_remove(manager, ptr);
+		chunk_set_prev(n_chunk, prev);
+		chunk_set_next(n_chunk, next);
+		chunk_set_next(prev, n_chunk);
+		prev->lrc = calculateLRC(prev);
+		if (next != NULL) {
+			chunk_set_prev(next, n_chunk);
+			next->lrc = calculateLRC(next);
+		} else {
+			manager->last_memory_chunk = n_chunk;
+		}
+		index_insert(manager, n_chunk);
+		if (manager->rover == ptr) {
+			manager->rover = n_chunk;
+		}
+		ptr = n_chunk;
+	}
+	// SPLIT CASE NEXT BLOCK
+	if (n_chunk != ptr) {
+		chunk_link_after(manager, ptr, n_chunk);
+		ptr->size = (uint8_t *)n_chunk - (uint8_t *)(ptr + 1);
+		ptr->lrc = calculateLRC(ptr);
+		bin_insert(manager, ptr);
+		ptr = n_chunk;
+	}
+	ptr->free = 0;
+	chunk_split_tail(manager, ptr, data + size + FEN_SIZE);
+	ptr->size = size;
+	// A SLAB COUNTS AS THE BYTES OF ITS OBJECTS
+	if (filename != slab_tag) {
+		stats_use(manager, 0, size);
+	}
+	chunk_set_debug(ptr, filename, fileline);
+	ptr->lrc = calculateLRC(ptr);
+	return ptr;
+}
+static void *chunk_use(struct memory_manager_t *manager, struct memory_chunk_t *ptr, uint8_t *data, size_t size, int zero, int fileline, const char *filename) {
+	bin_remove(manager, ptr);
+	ptr = chunk_place(manager, ptr, data, size, fileline, filename);
+	if (zero) {
+		return set_fences_fill(ptr + 1, size);
 	}
-	for (int i = 0; i < FEN_SIZE; ++i) {
-		*((uint8_t *)(address) + i) = 0xFF;
-		*((uint8_t *)(address) + FEN_SIZE + size + i) = 0xFF;
+	return set_fences(ptr + 1, size);
+}
+static void *allocate_block(struct memory_manager_t *manager, size_t size, size_t alignment, int zero, int fileline, const char *filename);
+static void release_block(struct memory_manager_t *manager, void *address);
+static void block_free(struct memory_manager_t *manager, void *address);
+static void trim_check(struct memory_manager_t *manager);
+
+static void slab_link(struct memory_manager_t *manager, struct memory_slab_t *slab) {
+	size_t c = slab->size / SLAB_CLASS - 1;
+	slab->prev = NULL;
+	slab->next = manager->slabs[c];
+	if (slab->next != NULL) {
+		slab->next->prev = slab;
+	}
+	manager->slabs[c] = slab;
+}
+static void slab_unlink(struct memory_manager_t *manager, struct memory_slab_t *slab) {
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		manager->slabs[slab->size / SLAB_CLASS - 1] = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
 	}
-	return (void *)((uint8_t *)(address) + FEN_SIZE);
 }
-void *set_fences_fill(void *address, size_t size) {
-	if (address == NULL || size < 1) {
+// Objects are found through the header at the start of their page, which has to be the data
+// of a used chunk tagged as a slab
+static struct memory_slab_t *slab_from_pointer(struct memory_manager_t *manager, const void *address) {
+	if (SLAB_CLASSES == 0) {
 		return NULL;
 	}
-	for (int i = 0; i < FEN_SIZE; ++i) {
-		*((uint8_t *)(address) + i) = 0xFF;
-		*((uint8_t *)(address) + FEN_SIZE + size + i) = 0xFF;
+	struct memory_slab_t *slab = (struct memory_slab_t *)((intptr_t)address & ~(intptr_t)(SLAB_SIZE - 1));
+	if ((const void *)slab == address) {
+		return NULL;
 	}
-	memset((uint8_t *)(address) + FEN_SIZE, 0, size);
-	return (void *)((uint8_t *)(address) + FEN_SIZE);
+	struct memory_chunk_t *ptr = chunk_from_pointer(manager, slab);
+	if (ptr == NULL || chunk_filename(ptr) != slab_tag || chunk_check(ptr) > 0) {
+		return NULL;
+	}
+	const uint8_t *object = address;
+	if (object < SLAB_OBJECTS(slab) || (object - SLAB_OBJECTS(slab)) % slab->size != 0 || (size_t)(object - SLAB_OBJECTS(slab)) / slab->size >= slab->count) {
+		return NULL;
+	}
+	return slab;
 }
-void heap_free(void *address) {
-	if (memory_manager.first_memory_chunk != NULL && address != NULL && heap_validate() == 0) {
-		struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-		while(ptr != NULL) {
-			// PTR EXISTS
-			if (address == (void *)((uint8_t *)(ptr + 1) + FEN_SIZE)) {
-				// FREE CURRENT BLOCK
-				ptr->free = 1;
-				// SET REAL SIZE
-				if (ptr->next != NULL) {
-					ptr->size = (uint8_t *)ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t);
-				} else {
-					ptr->size = (uint8_t *)memory_manager.memory_start + memory_manager.memory_size - (uint8_t *)ptr - sizeof(struct memory_chunk_t);
-				}
-				merge_chunks();
-				ptr->lrc = calculateLRC(ptr);
-				return;
-			}
-			ptr = ptr->next;
+static void *slab_alloc(struct memory_manager_t *manager, size_t size, int zero) {
+	size_t c = (size - 1) / SLAB_CLASS;
+	struct memory_slab_t *slab = manager->slabs[c];
+	// NEW SLAB CASE
+	if (slab == NULL) {
+		slab = allocate_block(manager, SLAB_DATA_SIZE, SLAB_SIZE, 0, 0, slab_tag);
+		if (slab == NULL) {
+			return NULL;
+		}
+		slab->size = (c + 1) * SLAB_CLASS;
+		slab->count = (SLAB_DATA_SIZE - SLAB_HEADER_SIZE - (2*WORD_SIZE - 1)) / (slab->size + 1);
+		slab->used = 0;
+		memset(slab->map, 0, sizeof(slab->map));
+		for (uint32_t i = 0; i < slab->count; ++i) {
+			slab->map[i / 64] |= (uint64_t)1 << (i % 64);
 		}
+		slab_link(manager, slab);
 	}
+	size_t word = 0;
+	while (slab->map[word] == 0) {
+		word++;
+	}
+	size_t i = word * 64 + __builtin_ctzll(slab->map[word]);
+	slab->map[word] &= slab->map[word] - 1;
+	// FULL SLAB
+	if (++slab->used == slab->count) {
+		slab_unlink(manager, slab);
+	}
+	SLAB_SLACK(slab)[i] = slab->size - size;
+	stats_use(manager, 0, size);
+	uint8_t *object = SLAB_OBJECTS(slab) + i * slab->size;
+	if (zero) {
+		memset(object, 0, size);
+	}
+	return object;
 }
-void merge_chunks(void) {
-	if (memory_manager.first_memory_chunk == NULL) {
+static void slab_free(struct memory_manager_t *manager, struct memory_slab_t *slab, void *address) {
+	size_t i = ((uint8_t *)address - SLAB_OBJECTS(slab)) / slab->size;
+	// DOUBLE FREE
+	if (SLAB_IS_FREE(slab, i)) {
 		return;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while (ptr != NULL) {
-		if (ptr->free) {
-			int lcs = 0;
-			struct memory_chunk_t *h_ptr = ptr;
-			while(1) {
-				if (h_ptr->free) {
-					lcs += 1;
-				} else {
-					h_ptr = h_ptr->prev;
-					break;
-				}
-				if (h_ptr->next == NULL) {
-					break;
-				}
-				h_ptr = h_ptr->next;
-			}
-			if (lcs > 1) {
-				if (h_ptr->next != NULL) {
-					h_ptr->next->prev = ptr;
-					h_ptr->next->lrc = calculateLRC(h_ptr->next);
-				}
-				ptr->next = h_ptr->next;
-				if (ptr->next == NULL) {
-					ptr->size = (size_t)((uint8_t *)memory_manager.memory_start + memory_manager.memory_size - (uint8_t *)ptr - sizeof(struct memory_chunk_t));
-				} else {
-					ptr->size = (uint8_t *)h_ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t);
-				}
-				ptr->lrc = calculateLRC(ptr);
-				break;
-			}
-		}
-		ptr = ptr->next;
+	slab->map[i / 64] |= (uint64_t)1 << (i % 64);
+	stats_use(manager, slab->size - SLAB_SLACK(slab)[i], 0);
+	if (slab->used-- == slab->count) {
+		slab_link(manager, slab);
+	}
+	// EMPTY SLAB CASE, the last one of a class is kept
+	if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+		slab_unlink(manager, slab);
+		release_block(manager, slab);
 	}
 }
 
-uint8_t calculateLRC(struct memory_chunk_t *ptr) {
-	uint8_t tmp = ptr->lrc;
-	ptr->lrc = 0;
-	uint8_t LRC = 0;
-	for (uint8_t i = 0; i < sizeof(struct memory_chunk_t); ++i) {
-		LRC = (LRC + *((uint8_t *)ptr + i)) & 0xFF;
+static size_t mapping_length(size_t length) {
+#ifdef HEAP_HUGE_PAGES
+	if (length >= HUGE_PAGE_SIZE) {
+		return (length + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
 	}
-	ptr->lrc = tmp;
-	return ((LRC ^ 0xFF) + 1) & 0xFF;
+#endif
+	return (length + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
 }
-int heap_validate(void) {
-	if (memory_manager.memory_start == NULL) {
-		return 2;
+// Mappings are page aligned, so any alignment up to PAGE_SIZE is met by the offset of the data
+static void *mapping_alloc(size_t size, size_t alignment, int fileline, const char *filename) {
+	size_t offset = (MAPPING_HEADER_SIZE + sizeof(struct memory_chunk_t) + FEN_SIZE + alignment - 1) & ~(alignment - 1);
+	if (size > MAX_BLOCK_SIZE) {
+		return NULL;
 	}
-	if (memory_manager.first_memory_chunk == NULL) {
-		return 0;
+	size_t length = mapping_length(offset + size + FEN_SIZE);
+	struct memory_mapping_t *mapping = custom_mmap(length);
+	if (mapping == (void *) - 1) {
+		return NULL;
 	}
-	// CHECK ALL LRC & FENCES
-	struct memory_chunk_t *ptr = memory_manager.first_memory_chunk;
-	while(ptr != NULL) {
-		if (ptr->lrc != calculateLRC(ptr)) {
-			return 3;
-		}
-		if (!ptr->free) {
-			for (int i = 0; i < FEN_SIZE; ++i) {
-				if (*((uint8_t *)(ptr) + sizeof(struct memory_chunk_t) + i) != 0xFF) {
-					return 1;
-				}
-				if (*((uint8_t *)(ptr) + sizeof(struct memory_chunk_t) + FEN_SIZE + ptr->size + i) != 0xFF) {
-					return 1;
+	mapping->length = length;
+	if (mapping_table_insert(mapping) != 0) {
+		custom_munmap(mapping, length);
+		return NULL;
+	}
+	mapping->prev = NULL;
+	mapping->next = mappings;
+	mapping->chunk = (struct memory_chunk_t *)((uint8_t *)mapping + offset - FEN_SIZE - sizeof(struct memory_chunk_t));
+	mapping->tag = MAPPING_TAG(mapping);
+	if (mappings != NULL) {
+		mappings->prev = mapping;
+	}
+	mappings = mapping;
+	memory_manager.stats.mapped_blocks++;
+	memory_manager.stats.mapped_size += length;
+	stats_use(&memory_manager, 0, size);
+	struct memory_chunk_t *ptr = mapping->chunk;
+	chunk_set_prev(ptr, NULL);
+	chunk_set_next(ptr, NULL);
+	ptr->size = size;
+	ptr->free = 0;
+	chunk_set_debug(ptr, filename, fileline);
+	ptr->lrc = calculateLRC(ptr);
+	// FRESH MAPPINGS ARE ALREADY ZEROED
+	return set_fences(ptr + 1, size);
+}
+static void mapping_release(struct memory_mapping_t *mapping) {
+	mapping_table_remove(mapping, 0);
+	mapping->tag = 0;
+	if (mapping->prev != NULL) {
+		mapping->prev->next = mapping->next;
+	} else {
+		mappings = mapping->next;
+	}
+	if (mapping->next != NULL) {
+		mapping->next->prev = mapping->prev;
+	}
+	memory_manager.stats.mapped_blocks--;
+	memory_manager.stats.mapped_size -= mapping->length;
+	stats_use(&memory_manager, mapping->chunk->size, 0);
+	custom_munmap(mapping, mapping->length);
+}
+// Allocates a block in a heap that has already been checked
+static void *block_alloc(struct memory_manager_t *manager, size_t size, size_t alignment, int zero, int fileline, const char *filename) {
+	// SLAB CASE, a regular block is used when no slab fits
+	if (SLAB_CLASSES > 0 && size <= HEAP_SLAB_MAX_SIZE && alignment <= WORD_SIZE && filename == NULL) {
+		void *object = slab_alloc(manager, size, zero);
+		if (object != NULL) {
+			return object;
+		}
+	}
+	// MAPPED BLOCK CASE, the heap is used when no mapping can be made. Slabs always stay in the heap
+	if (manager == &memory_manager && heap_config.mmap_threshold > 0 && size >= heap_config.mmap_threshold && alignment <= PAGE_SIZE && filename != slab_tag) {
+		void *block = mapping_alloc(size, alignment, fileline, filename);
+		if (block != NULL) {
+			return block;
+		}
+	}
+	uint8_t *data = NULL;
+	struct memory_chunk_t *ptr = free_find(manager, size, alignment, &data);
+	// EXPAND HEAP CASE
+	if (ptr == NULL) {
+		ptr = heap_grow(manager, size, alignment);
+		if (ptr == NULL) {
+			return NULL;
+		}
+		data = chunk_placement(ptr, size, alignment);
+	}
+	if (chunk_check(ptr) > 0) {
+		return NULL;
+	}
+	return chunk_use(manager, ptr, data, size, zero, fileline, filename);
+}
+static void *allocate_block(struct memory_manager_t *manager, size_t size, size_t alignment, int zero, int fileline, const char *filename) {
+	if (manager->memory_start == NULL || size < 1 || size > MAX_BLOCK_SIZE || heap_check(manager) > 0) {
+		return NULL;
+	}
+	return block_alloc(manager, size, alignment, zero, fileline, filename);
+}
+// Carves count blocks out of one free region, placing them back to back so no block needs a
+// search of its own. Slab objects and mapped blocks are allocated one by one
+static int allocate_batch(struct memory_manager_t *manager, size_t size, size_t count, void **blocks) {
+	if (manager->memory_start == NULL || size < 1 || count < 1 || blocks == NULL || size > MAX_BLOCK_SIZE) {
+		return -1;
+	}
+	size_t span = (sizeof(struct memory_chunk_t) + 2*FEN_SIZE + size + WORD_SIZE - 1) & ~(WORD_SIZE - 1);
+	if (count > SIZE_MAX / 2 / span || heap_check(manager) > 0) {
+		return -1;
+	}
+	if (size <= HEAP_SLAB_MAX_SIZE || (heap_config.mmap_threshold > 0 && size >= heap_config.mmap_threshold)) {
+		for (size_t i = 0; i < count; ++i) {
+			blocks[i] = block_alloc(manager, size, WORD_SIZE, 0, 0, NULL);
+			// ROLLBACK CASE
+			if (blocks[i] == NULL) {
+				while (i > 0) {
+					block_free(manager, blocks[--i]);
 				}
+				trim_check(manager);
+				return -1;
 			}
 		}
-		ptr = ptr->next;
+		return 0;
+	}
+	// THE REGION IS FOUND AS FOR ONE BLOCK SPANNING ALL OF THEM
+	size_t total = count * span - sizeof(struct memory_chunk_t) - 2*FEN_SIZE;
+	uint8_t *data = NULL;
+	struct memory_chunk_t *ptr = free_find(manager, total, WORD_SIZE, &data);
+	if (ptr == NULL) {
+		ptr = heap_grow(manager, total, WORD_SIZE);
+		if (ptr == NULL) {
+			return -1;
+		}
+		data = chunk_placement(ptr, total, WORD_SIZE);
+	}
+	if (chunk_check(ptr) > 0) {
+		return -1;
+	}
+	bin_remove(manager, ptr);
+	for (size_t i = 0; i < count; ++i) {
+		ptr = chunk_place(manager, ptr, data, size, 0, NULL);
+		blocks[i] = set_fences(ptr + 1, size);
+		// THE TAIL SPLIT OFF IS WHERE THE NEXT BLOCK GOES
+		if (i + 1 < count) {
+			ptr = chunk_next(ptr);
+			bin_remove(manager, ptr);
+			data = (uint8_t *)(ptr + 1) + FEN_SIZE;
+		}
 	}
 	return 0;
 }
-
-void* heap_malloc_aligned(size_t count) {
-	if (memory_manager.memory_start == NULL || count < 1 || heap_validate() > 0) {
+static void *reallocate_block(struct memory_manager_t *manager, void *memblock, size_t size, size_t alignment, int fileline, const char *filename) {
+	if (manager->memory_start == NULL || size > MAX_BLOCK_SIZE || heap_check(manager) > 0) {
 		return NULL;
 	}
-	int size = count;
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		// ALLOC NEW BLOCK
-		if (memory_manager.memory_size < (size_t)(PAGE_SIZE + size + FEN_SIZE)) {
-			void *request = custom_sbrk(PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size);
-			if (request == (void *) - 1) {
-				return NULL;
+	if (memblock == NULL) {
+		return allocate_block(manager, size, alignment, 0, fileline, filename);
+	}
+	if (size == 0) {
+		release_block(manager, memblock);
+		return NULL;
+	}
+	struct memory_slab_t *slab = slab_from_pointer(manager, memblock);
+	// SLAB OBJECT CASE
+	if (slab != NULL) {
+		size_t i = ((uint8_t *)memblock - SLAB_OBJECTS(slab)) / slab->size;
+		size_t length = slab->size - SLAB_SLACK(slab)[i];
+		if (size <= slab->size && filename == NULL && ((intptr_t)memblock & (intptr_t)(alignment - 1)) == 0) {
+			stats_use(manager, length, size);
+			SLAB_SLACK(slab)[i] = slab->size - size;
+			return memblock;
+		}
+		uint8_t *req = allocate_block(manager, size, alignment, 0, fileline, filename);
+		if (req == NULL) {
+			return NULL;
+		}
+		memcpy(req, memblock, length < size ? length : size);
+		slab_free(manager, slab, memblock);
+		return req;
+	}
+	struct memory_mapping_t *mapping = mapping_from_pointer(manager, memblock);
+	// MAPPED BLOCK CASE, the block stays in its mapping while it fits and is big enough for one
+	if (mapping != NULL) {
+		struct memory_chunk_t *ptr = mapping->chunk;
+		if (chunk_check(ptr) > 0) {
+			return NULL;
+		}
+		uint8_t *required_end = (uint8_t *)memblock + size + FEN_SIZE;
+		if (size >= heap_config.mmap_threshold && required_end <= (uint8_t *)mapping + mapping->length && ((intptr_t)memblock & (intptr_t)(alignment - 1)) == 0) {
+			size_t length = mapping_length(required_end - (uint8_t *)mapping);
+			if (length < mapping->length && custom_munmap((uint8_t *)mapping + length, mapping->length - length) == 0) {
+				mapping_table_remove(mapping, length);
+				manager->stats.mapped_size -= mapping->length - length;
+				mapping->length = length;
 			}
-			memory_manager.memory_size += PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size;
-		}
-		struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)((uint8_t *)memory_manager.memory_start + PAGE_SIZE - sizeof(struct memory_chunk_t) - FEN_SIZE);
-		n_chunk->next = NULL;
-		n_chunk->size = size;
-		n_chunk->free = 0;
-		
-		// ALLOC FREE BLOCK
-		struct memory_chunk_t *b_chunk = (struct memory_chunk_t *)memory_manager.memory_start;
-		b_chunk->prev = NULL;
-		b_chunk->size = (size_t)((uint8_t *)n_chunk - (uint8_t *)b_chunk - sizeof(struct memory_chunk_t));
-		b_chunk->free = 1;
-
-
-		// CORRECT PTRS & LRCs
-		b_chunk->next = n_chunk;
-		n_chunk->prev = b_chunk;
-		b_chunk->lrc = calculateLRC(b_chunk);
-		n_chunk->lrc = calculateLRC(n_chunk);
-
-		memory_manager.first_memory_chunk = b_chunk;
-		return set_fences(n_chunk + 1, size);
+			stats_use(manager, ptr->size, size);
+			ptr->size = size;
+			chunk_set_debug(ptr, filename, fileline);
+			ptr->lrc = calculateLRC(ptr);
+			return set_fences(ptr + 1, size);
+		}
+		uint8_t *req = allocate_block(manager, size, alignment, 0, fileline, filename);
+		if (req == NULL) {
+			return NULL;
+		}
+		memcpy(req, memblock, ptr->size < size ? ptr->size : size);
+		mapping_release(mapping);
+		return req;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// PAGE COND
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				if (ptr->size >= (size_t)size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
+	struct memory_chunk_t* ptr = chunk_from_pointer(manager, memblock);
+	// INVAID PTR
+	if (ptr == NULL || chunk_check(ptr) > 0) {
+		return NULL;
+	}
+	if (((intptr_t)memblock & (intptr_t)(alignment - 1)) == 0) {
+		uint8_t *required_end = (uint8_t *)memblock + size + FEN_SIZE;
+		struct memory_chunk_t *next = chunk_next(ptr);
+		if (required_end > chunk_end(manager, ptr)) {
+			int next_free = next != NULL && next->free;
+			uint8_t *end = next_free ? chunk_end(manager, next) : chunk_end(manager, ptr);
+			// EXPAND LAST BLOCK CASE, the heap grows behind ptr or behind a free top chunk
+			if (required_end > end && (next == NULL || (next_free && chunk_next(next) == NULL))) {
+				if (heap_extend(manager, required_end - end) == 0) {
+					end = (uint8_t *)manager->memory_start + manager->memory_size;
 				}
 			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// PAGE COND
-				if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-					// LEFT COND
-					if (i >= (size_t)(3*FEN_SIZE + sizeof(struct memory_chunk_t) + 1)) {
-						// RIGHT COND
-						if (ptr->size - i >= (size_t)size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->lrc = calculateLRC(a_chunk);
-								
-								n_chunk->next = a_chunk;
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							} else {
-								n_chunk->next = ptr->next;
-								
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							}
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1) - sizeof(struct memory_chunk_t) - FEN_SIZE;
-							
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-							
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences(n_chunk + 1, size);
-						}
-					}
-				}
+			// IF NEXT IS FREE, it is merged only when the block fits, so a failed growth leaves it binned
+			if (next_free && required_end <= end) {
+				bin_remove(manager, next);
+				chunk_unlink(manager, next);
 			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// PAGE COND
-		if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				struct memory_chunk_t *a_chunk  = custom_sbrk(0);
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				ptr->next = n_chunk;
-				// NEW BLOCK CASE
-				if (i - FEN_SIZE - sizeof(struct memory_chunk_t) >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-					a_chunk->prev = ptr;
-					a_chunk->next = n_chunk;
-					a_chunk->size = i - 2*sizeof(struct memory_chunk_t) - 3*FEN_SIZE;
-					a_chunk->free = 1;
-					a_chunk->lrc = calculateLRC(a_chunk);
-
-					n_chunk->prev = a_chunk;
-					ptr->next = a_chunk;
-				}
-				n_chunk->lrc = calculateLRC(n_chunk);
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences(n_chunk + 1, size);	
+		}
+		// FITS
+		if (required_end <= chunk_end(manager, ptr)) {
+			chunk_split_tail(manager, ptr, required_end);
+			stats_use(manager, ptr->size, size);
+			ptr->size = size;
+			chunk_set_debug(ptr, filename, fileline);
+			ptr->lrc = calculateLRC(ptr);
+			return set_fences(ptr + 1, size);
+		}
+	}
+	// BACKWARD EXPANSION CASE
+	struct memory_chunk_t *prev = chunk_prev(ptr);
+	if (prev != NULL && prev->free) {
+		struct memory_chunk_t *next = chunk_next(ptr);
+		uint8_t *end = next != NULL && next->free ? chunk_end(manager, next) : chunk_end(manager, ptr);
+		uint8_t *data = (uint8_t *)(prev + 1) + chunk_data_offset(prev, alignment, chunk_prev(prev) != NULL);
+		if (data + size + FEN_SIZE <= end) {
+			size_t length = ptr->size < size ? ptr->size : size;
+			if (next != NULL && next->free) {
+				bin_remove(manager, next);
+				chunk_unlink(manager, next);
 			}
+			bin_remove(manager, prev);
+			stats_use(manager, ptr->size, 0);
+			chunk_unlink(manager, ptr);
+			// THE DATA IS MOVED BEFORE ANY CONTROL BLOCK OR FENCE OVERWRITES IT
+			memmove(data, memblock, length);
+			prev = chunk_place(manager, prev, data, size, fileline, filename);
+			return set_fences(prev + 1, size);
 		}
 	}
-	return NULL;
-}
-void* heap_malloc_aligned_zero(size_t count) {
-	if (memory_manager.memory_start == NULL || count < 1 || heap_validate() > 0) {
+	// ADD NEW BLOCK CASE
+	uint8_t *req = allocate_block(manager, size, alignment, 0, fileline, filename);
+	if (req == NULL) {
 		return NULL;
 	}
-	int size = count;
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		// ALLOC NEW BLOCK
-		if (memory_manager.memory_size < (size_t)(PAGE_SIZE + size + FEN_SIZE)) {
-			void *request = custom_sbrk(PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size);
-			if (request == (void *) - 1) {
-				return NULL;
+	memcpy(req, memblock, ptr->size < size ? ptr->size : size);
+	release_block(manager, memblock);
+	return req;
+}
+// Shrinks a free top chunk to pad bytes and returns the rest, the chunk goes away entirely when
+// pad is 0. The heap never gets smaller than DEFAULT_SIZE
+static void trim_top(struct memory_manager_t *manager, size_t pad) {
+	struct memory_chunk_t *top = manager->last_memory_chunk;
+	if (top == NULL || !top->free) {
+		return;
+	}
+	uint8_t *memory_end = (uint8_t *)manager->memory_start + manager->memory_size;
+	uint8_t *floor = (uint8_t *)manager->memory_start + DEFAULT_SIZE;
+	uint8_t *new_end = (uint8_t *)top;
+	if (pad > 0 || new_end < floor) {
+		new_end = (uint8_t *)(top + 1) + (pad > MIN_FREE_SIZE ? pad : MIN_FREE_SIZE);
+	}
+	if (new_end < floor) {
+		new_end = floor;
+	}
+	if (new_end >= memory_end) {
+		return;
+	}
+	// THE HEAP IS SHRUNK FIRST, unlocked range checks must not reach memory being released
+	manager_set_size(manager, manager->memory_size - (memory_end - new_end));
+	if (heap_sbrk(manager, -(intptr_t)(memory_end - new_end)) == (void *) - 1) {
+		manager_set_size(manager, manager->memory_size + (memory_end - new_end));
+		return;
+	}
+	bin_remove(manager, top);
+	// REMOVE TOP CASE
+	if (new_end == (uint8_t *)top) {
+		chunk_unlink(manager, top);
+		manager->last_memory_chunk->lrc = calculateLRC(manager->last_memory_chunk);
+		return;
+	}
+	top->size = new_end - (uint8_t *)(top + 1);
+	top->lrc = calculateLRC(top);
+	bin_insert(manager, top);
+}
+// Empty slabs kept for their class are given back to the heap as well
+static void slab_release_empty(struct memory_manager_t *manager) {
+	for (size_t c = 0; c < sizeof(manager->slabs) / sizeof(manager->slabs[0]); ++c) {
+		struct memory_slab_t *slab = manager->slabs[c];
+		while (slab != NULL) {
+			struct memory_slab_t *next = slab->next;
+			if (slab->used == 0) {
+				slab_unlink(manager, slab);
+				release_block(manager, slab);
 			}
-			memory_manager.memory_size += PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size;
-		}
-		struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)((uint8_t *)memory_manager.memory_start + PAGE_SIZE - sizeof(struct memory_chunk_t) - FEN_SIZE);
-		n_chunk->next = NULL;
-		n_chunk->size = size;
-		n_chunk->free = 0;
-		
-		// ALLOC FREE BLOCK
-		struct memory_chunk_t *b_chunk = (struct memory_chunk_t *)memory_manager.memory_start;
-		b_chunk->prev = NULL;
-		b_chunk->size = (size_t)((uint8_t *)n_chunk - (uint8_t *)b_chunk - sizeof(struct memory_chunk_t));
-		b_chunk->free = 1;
-
-
-		// CORRECT PTRS & LRCs
-		b_chunk->next = n_chunk;
-		n_chunk->prev = b_chunk;
-		b_chunk->lrc = calculateLRC(b_chunk);
-		n_chunk->lrc = calculateLRC(n_chunk);
-
-		memory_manager.first_memory_chunk = b_chunk;
-		return set_fences_fill(n_chunk + 1, size);
+			slab = next;
+		}
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// PAGE COND
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				if (ptr->size >= (size_t)size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
+}
+// Frees a block of a heap that has already been checked, the top is trimmed by the caller
+static void block_free(struct memory_manager_t *manager, void *address) {
+	struct memory_mapping_t *mapping = mapping_from_pointer(manager, address);
+	// MAPPED BLOCK CASE
+	if (mapping != NULL) {
+		if (chunk_check(mapping->chunk) == 0) {
+			mapping_release(mapping);
+		}
+		return;
+	}
+	struct memory_slab_t *slab = slab_from_pointer(manager, address);
+	// SLAB OBJECT CASE
+	if (slab != NULL) {
+		slab_free(manager, slab, address);
+		return;
+	}
+	struct memory_chunk_t* ptr = chunk_from_pointer(manager, address);
+	// PTR EXISTS
+	if (ptr != NULL && chunk_check(ptr) == 0) {
+		// FREE CURRENT BLOCK
+		if (chunk_filename(ptr) != slab_tag) {
+			stats_use(manager, ptr->size, 0);
+		}
+		ptr->free = 1;
+		chunk_coalesce(manager, ptr);
+	}
+}
+// Slab data of a used chunk tagged as a slab that has no objects in use, NULL for anything else
+static struct memory_slab_t *slab_empty(struct memory_chunk_t *ptr) {
+	if (ptr == NULL || ptr->free || chunk_filename(ptr) != slab_tag) {
+		return NULL;
+	}
+	struct memory_slab_t *slab = (struct memory_slab_t *)((uint8_t *)(ptr + 1) + FEN_SIZE);
+	return slab->used == 0 ? slab : NULL;
+}
+// Empty slabs kept for their class are released when they are all that holds the free top
+// chunk under the threshold
+static void trim_check(struct memory_manager_t *manager) {
+	struct memory_chunk_t *top = manager->last_memory_chunk;
+	if (top == NULL || !top->free || heap_config.trim_threshold == 0) {
+		return;
+	}
+	if (top->size < heap_config.trim_threshold) {
+		struct memory_chunk_t *start = top;
+		while (chunk_prev(start) != NULL && (chunk_prev(start)->free || slab_empty(chunk_prev(start)) != NULL)) {
+			start = chunk_prev(start);
+		}
+		if ((size_t)(chunk_end(manager, top) - (uint8_t *)start) < heap_config.trim_threshold) {
+			return;
+		}
+		// RELEASE EMPTY SLABS, each one merges into the top chunk
+		while (top != start) {
+			struct memory_slab_t *slab = slab_empty(chunk_prev(top));
+			slab_unlink(manager, slab);
+			block_free(manager, slab);
+			// A SLAB THAT FAILS ITS CHECK IS LEFT IN PLACE
+			if (manager->last_memory_chunk == top) {
+				slab_link(manager, slab);
+				return;
 			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// PAGE COND
-				if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-					// LEFT COND
-					if (i >= (size_t)(3*FEN_SIZE + sizeof(struct memory_chunk_t) + 1)) {
-						// RIGHT COND
-						if (ptr->size - i >= (size_t)size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->lrc = calculateLRC(a_chunk);
-								
-								n_chunk->next = a_chunk;
+			top = manager->last_memory_chunk;
+		}
+	}
+	trim_top(manager, heap_config.grow_min);
+}
+static void release_block(struct memory_manager_t *manager, void *address) {
+	if ((manager->first_memory_chunk != NULL || mappings != NULL) && address != NULL && heap_check(manager) == 0) {
+		block_free(manager, address);
+		// TRIM CASE
+		trim_check(manager);
+	}
+}
 
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							} else {
-								n_chunk->next = ptr->next;
-								
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							}
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1) - sizeof(struct memory_chunk_t) - FEN_SIZE;
-							
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-							
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->lrc = calculateLRC(ptr);
-							
-							return set_fences_fill(n_chunk + 1, size);
-						}
-					}
-				}
+#ifdef HEAP_THREAD_SAFE
+// Gives every block cached by the calling thread back to the heap, also run when the thread exits
+static void thread_cache_flush(void *cache) {
+	(void)cache;
+	HEAP_LOCK(&memory_manager);
+	if (thread_cache.generation == heap_generation) {
+		for (unsigned int i = 0; i < thread_cache.pending_count; ++i) {
+			release_block(&memory_manager, thread_cache.pending[i]);
+		}
+		for (size_t c = 0; c < TCACHE_CLASSES; ++c) {
+			while (thread_cache.blocks[c] != NULL) {
+				void *block = thread_cache.blocks[c];
+				thread_cache.blocks[c] = *(void **)block;
+				release_block(&memory_manager, block);
 			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// PAGE COND
-		if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				struct memory_chunk_t *a_chunk  = custom_sbrk(0);
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				ptr->next = n_chunk;
-				// NEW BLOCK CASE
-				if (i - FEN_SIZE - sizeof(struct memory_chunk_t) >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-					a_chunk->prev = ptr;
-					a_chunk->next = n_chunk;
-					a_chunk->size = i - 2*sizeof(struct memory_chunk_t) - 3*FEN_SIZE;
-					a_chunk->free = 1;
-					a_chunk->lrc = calculateLRC(a_chunk);
-
-					n_chunk->prev = a_chunk;
-					ptr->next = a_chunk;
-				}
-				n_chunk->lrc = calculateLRC(n_chunk);
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences_fill(n_chunk + 1, size);	
+		}
+	}
+	memset(thread_cache.count, 0, sizeof(thread_cache.count));
+	memset(thread_cache.blocks, 0, sizeof(thread_cache.blocks));
+	thread_cache.pending_count = 0;
+	HEAP_UNLOCK(&memory_manager);
+}
+static void thread_cache_key_create(void) {
+	pthread_key_create(&thread_cache_key, thread_cache_flush);
+}
+// Blocks of a heap that was cleaned in the meantime must not be reused
+static int thread_cache_current(void) {
+	unsigned long generation = __atomic_load_n(&heap_generation, __ATOMIC_ACQUIRE);
+	if (thread_cache.generation == generation) {
+		return 1;
+	}
+	memset(&thread_cache, 0, sizeof(thread_cache));
+	thread_cache.generation = generation;
+	pthread_once(&thread_cache_once, thread_cache_key_create);
+	pthread_setspecific(thread_cache_key, &thread_cache);
+	return 0;
+}
+// Runs with the lock held. A pending block is only cached once it passes the checks heap_free
+// does, anything else and blocks of a full class take the locked path
+static void thread_cache_admit(void) {
+	for (unsigned int i = 0; i < thread_cache.pending_count; ++i) {
+		void *block = thread_cache.pending[i];
+		struct memory_chunk_t *ptr = chunk_from_pointer(&memory_manager, block);
+		if (ptr == NULL || chunk_check(ptr) > 0 || ptr->size > TCACHE_MAX_SIZE || ptr->size % TCACHE_CLASS != 0 || chunk_fences_intact(ptr) == 0) {
+			release_block(&memory_manager, block);
+			continue;
+		}
+		size_t c = ptr->size / TCACHE_CLASS - 1;
+		if (thread_cache.count[c] >= TCACHE_COUNT) {
+			release_block(&memory_manager, block);
+			continue;
+		}
+		((void **)block)[0] = thread_cache.blocks[c];
+		((void **)block)[1] = &thread_cache;
+		thread_cache.blocks[c] = block;
+		thread_cache.count[c]++;
+	}
+	thread_cache.pending_count = 0;
+}
+// Small blocks are rounded up to their class so a cached block fits any request of the class
+// without touching its control block, which other threads may update under the lock
+static void *thread_cache_get(size_t size) {
+	size_t c = (size - 1) / TCACHE_CLASS;
+	thread_cache_current();
+	if (thread_cache.count[c] == 0) {
+		HEAP_LOCK(&memory_manager);
+		thread_cache_admit();
+		// REFILL BATCH
+		for (int i = 0; thread_cache.count[c] == 0 && i < TCACHE_BATCH; ++i) {
+			void *block = allocate_block(&memory_manager, (c + 1) * TCACHE_CLASS, WORD_SIZE, 0, 0, NULL);
+			if (block == NULL) {
+				break;
 			}
+			*(void **)block = thread_cache.blocks[c];
+			thread_cache.blocks[c] = block;
+			thread_cache.count[c]++;
+		}
+		HEAP_UNLOCK(&memory_manager);
+		if (thread_cache.count[c] == 0) {
+			return NULL;
 		}
 	}
-	return NULL;
+	void *block = thread_cache.blocks[c];
+	thread_cache.blocks[c] = *(void **)block;
+	thread_cache.count[c]--;
+	return block;
+}
+static int thread_cache_put(void *address) {
+	if (address == NULL || !thread_cache_current() || ((intptr_t)address & (intptr_t)(WORD_SIZE - 1)) != 0) {
+		return 0;
+	}
+	// Only the heap bounds and fields written by the owner of the block are read without the lock,
+	// the checksum and the links are checked by thread_cache_admit
+	if ((uint8_t *)address < (uint8_t *)memory_manager.memory_start + sizeof(struct memory_chunk_t) + FEN_SIZE) {
+		return 0;
+	}
+	// MAPPED BLOCKS AND FOREIGN POINTERS ARE LEFT TO release_block
+	if ((uint8_t *)address >= (uint8_t *)memory_manager.memory_start + __atomic_load_n(&heap_published_size, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	struct memory_chunk_t *ptr = (struct memory_chunk_t *)((uint8_t *)address - FEN_SIZE - sizeof(struct memory_chunk_t));
+	if (ptr->free || ptr->size > TCACHE_MAX_SIZE || ptr->size % TCACHE_CLASS != 0 || chunk_fences_intact(ptr) == 0) {
+		return 0;
+	}
+	// DOUBLE FREE CHECK
+	for (unsigned int i = 0; i < thread_cache.pending_count; ++i) {
+		if (thread_cache.pending[i] == address) {
+			return 1;
+		}
+	}
+	if (((void **)address)[1] == &thread_cache) {
+		for (void *block = thread_cache.blocks[ptr->size / TCACHE_CLASS - 1]; block != NULL; block = *(void **)block) {
+			if (block == address) {
+				return 1;
+			}
+		}
+	}
+	thread_cache.pending[thread_cache.pending_count++] = address;
+	// ADMIT BATCH
+	if (thread_cache.pending_count == TCACHE_BATCH) {
+		HEAP_LOCK(&memory_manager);
+		thread_cache_admit();
+		HEAP_UNLOCK(&memory_manager);
+	}
+	return 1;
+}
+#endif
+
+static uint64_t trace_clock(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+// One fwrite per record, stdio keeps the records of concurrent calls whole
+static void trace_record(enum heap_trace_op_t op, size_t alignment, const void *address, const void *result, size_t size) {
+	struct heap_trace_record_t record;
+	record.time = trace_clock() - trace_start;
+	record.address = (uintptr_t)address;
+	record.result = (uintptr_t)result;
+	record.size_op = (uint64_t)size << 16 | (uint64_t)__builtin_ctzll(alignment) << 8 | op;
+	fwrite(&record, sizeof(record), 1, trace_file);
+}
+int heap_trace_start(const char *path) {
+	if (trace_file != NULL || path == NULL) {
+		return -1;
+	}
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		return -1;
+	}
+	uint32_t header[2] = { sizeof(struct heap_trace_record_t), 0 };
+	if (fwrite(HEAP_TRACE_MAGIC, 8, 1, file) != 1 || fwrite(header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return -1;
+	}
+	trace_start = trace_clock();
+	trace_file = file;
+	return 0;
 }
-void* heap_calloc_aligned(size_t number, size_t size) {
-	if (memory_manager.memory_start == NULL || size < 1 || number < 1 || heap_validate() > 0) {
-		return NULL;
+void heap_trace_stop(void) {
+	if (trace_file == NULL) {
+		return;
 	}
-	return heap_malloc_aligned_zero(number*size);
+	FILE *file = trace_file;
+	trace_file = NULL;
+	fclose(file);
 }
-void* heap_realloc_aligned(void* memblock, size_t size) {
-	if (memory_manager.memory_start == NULL || heap_validate() > 0) {
-		return NULL;
+
+static void *heap_allocate(size_t size, size_t alignment, int zero, int fileline, const char *filename) {
+	void *block = NULL;
+#ifdef HEAP_THREAD_SAFE
+	// THREAD CACHE CASE
+	if (alignment == WORD_SIZE && filename == NULL && size > 0 && size <= TCACHE_MAX_SIZE) {
+		block = thread_cache_get(size);
+		if (block != NULL && zero) {
+			memset(block, 0, size);
+		}
+	}
+#endif
+	if (block == NULL) {
+		HEAP_LOCK(&memory_manager);
+		block = allocate_block(&memory_manager, size, alignment, zero, fileline, filename);
+		HEAP_UNLOCK(&memory_manager);
+	}
+	if (trace_file != NULL) {
+		trace_record(zero ? trace_calloc : trace_malloc, alignment, NULL, block, size);
 	}
+	return block;
+}
+static void *heap_reallocate(void *memblock, size_t size, size_t alignment, int fileline, const char *filename) {
 	if (memblock == NULL) {
-		return heap_malloc_aligned(size);
+		return heap_allocate(size, alignment, 0, fileline, filename);
 	}
 	if (size == 0) {
 		heap_free(memblock);
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(ptr != NULL) {
-		if (memblock == (void *)((uint8_t *)(ptr + 1) + FEN_SIZE)) {
-			// FREE BLOCK PTR
-			if (ptr->free == 1) {
-				return NULL;
-			}
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				size_t real_sum = ptr->size;
-				if (ptr->next != NULL) {
-					real_sum = (uint8_t *)ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t) - 2*FEN_SIZE;
-				}
-				// FITS
-				if (real_sum >= size) {
-					if (real_sum - size >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = real_sum - size - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-							ptr->next = a_chunk;
-						}
-					}
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size - real_sum);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size - real_sum;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// IF NEXT IS FREE
-				if (ptr->next != NULL && ptr->next->free == 1) {
-					size_t right_size = ptr->next->size;
-					if (ptr->next->next != NULL) {
-						right_size = (uint8_t *)ptr->next->next - (uint8_t *)ptr->next;
-					}
-					// IF IT HAS THE SPACE
-					if (right_size + real_sum >= size) {
-						if (ptr->next->next != NULL) {
-							ptr->next->next->prev = ptr;
-							ptr->next->next->lrc = calculateLRC(ptr->next->next);
-						}
-						ptr->next = ptr->next->next;
-						ptr->size = size;
-						ptr->lrc = calculateLRC(ptr);
-						return set_fences(ptr + 1, size);
-					}
-				}
-			}
-			// ADD NEW BLOCK CASE
-			uint8_t *req = heap_malloc_aligned(size);
-			if (req == NULL) {
-				return NULL;
-			}
-			memcpy(req, memblock, ptr->size);
-			heap_free(memblock);
-			return req;
-		}
-		ptr = ptr->next;
+	HEAP_LOCK(&memory_manager);
+	void *block = reallocate_block(&memory_manager, memblock, size, alignment, fileline, filename);
+	HEAP_UNLOCK(&memory_manager);
+	if (trace_file != NULL) {
+		trace_record(trace_realloc, alignment, memblock, block, size);
 	}
-	// INVAID PTR
-	return NULL;
+	return block;
 }
 
-void* heap_malloc_debug(size_t count, int fileline, const char* filename) {
-	size_t size = count;
-	if (memory_manager.memory_start == NULL || size < 1 || heap_validate() > 0) {
-		return NULL;
-	}
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		uint8_t *ptr_i = (uint8_t *)memory_manager.memory_start;
-		for (size_t i = 0 ; i < memory_manager.memory_size; ++i, ++ptr_i) {
-			// LEFT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				// WORD SIZE COND
-				if ((intptr_t)ptr_i % sizeof(void *) == 0) {
-					// RIGHT COND
-					if (memory_manager.memory_size - i < size + FEN_SIZE) {
-						void *req = custom_sbrk(size + FEN_SIZE - memory_manager.memory_size + i);
-						if (req == (void *) - 1) {
-							return NULL;
-						}
-						memory_manager.memory_size += size + FEN_SIZE - memory_manager.memory_size + i;
-					}
-					struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-					n_chunk->prev = NULL;
-					n_chunk->next = NULL;
-					n_chunk->size = size;
-					n_chunk->free = 0;
-					n_chunk->filename = filename;
-					n_chunk->fileline = fileline;
-					n_chunk->lrc = calculateLRC(n_chunk);
-					memory_manager.first_memory_chunk = n_chunk;
-					return set_fences(n_chunk + 1, size);
-				}
-			}
-		}
+void *heap_malloc(size_t size) {
+	return heap_allocate(size, WORD_SIZE, 0, 0, NULL);
+}
+int heap_malloc_batch(size_t size, size_t count, void **blocks) {
+	HEAP_LOCK(&memory_manager);
+	int status = allocate_batch(&memory_manager, size, count, blocks);
+	HEAP_UNLOCK(&memory_manager);
+	for (size_t i = 0; trace_file != NULL && status == 0 && i < count; ++i) {
+		trace_record(trace_malloc, WORD_SIZE, NULL, blocks[i], size);
+	}
+	return status;
+}
+void *heap_malloc_zero(size_t size) {
+	return heap_allocate(size, WORD_SIZE, 1, 0, NULL);
+}
+void* heap_calloc(size_t number, size_t size) {
+	if (memory_manager.memory_start == NULL || size < 1 || number < 1) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// WORD SIZE COND
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				if (ptr->size >= size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->filename = filename;
-						a_chunk->fileline = fileline;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
+	return heap_malloc_zero(number*size);
+}
+void* heap_realloc(void* memblock, size_t size) {
+	return heap_reallocate(memblock, size, WORD_SIZE, 0, NULL);
+}
+size_t heap_get_largest_used_block_size(void) {
+#ifdef HEAP_THREAD_SAFE
+	thread_cache_flush(NULL);
+#endif
+	HEAP_LOCK(&memory_manager);
+	size_t max = 0;
+	if (memory_manager.memory_start != NULL && validate_chunks(&memory_manager) == 0) {
+		for (struct memory_chunk_t *ptr = memory_manager.first_memory_chunk; ptr != NULL; ptr = chunk_next(ptr)) {
+			size_t size = ptr->size;
+			// A slab counts as the requested sizes of its objects, empty slabs aren't in use
+			if (!ptr->free && chunk_filename(ptr) == slab_tag) {
+				struct memory_slab_t *slab = (struct memory_slab_t *)((uint8_t *)(ptr + 1) + FEN_SIZE);
+				size = 0;
+				for (uint32_t i = 0; i < slab->count; ++i) {
+					if (!SLAB_IS_FREE(slab, i) && slab->size - SLAB_SLACK(slab)[i] > size) {
+						size = slab->size - SLAB_SLACK(slab)[i];
 					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
 				}
 			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// WORD SIZE COND
-				if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-					// LEFT COND
-					if ((size_t)(ptr_i - (uint8_t *)(ptr + 1)) >= (size_t)((2*FEN_SIZE + 1) + sizeof(struct memory_chunk_t) + FEN_SIZE)) {
-						// RIGHT COND
-						if (ptr->size - i >= size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->filename = filename;
-							n_chunk->fileline = fileline;
-							n_chunk->free = 0;
-
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->filename = filename;
-								a_chunk->fileline = fileline;
-								a_chunk->lrc = calculateLRC(a_chunk);
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = a_chunk;
-							} else {
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = ptr->next;
-							}
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->filename = filename;
-							ptr->fileline = fileline;
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1);
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences(n_chunk + 1, size);
-						}
-					}
-				}
+			if (!ptr->free && size > max) {
+				max = size;
 			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// WORD SIZE COND
-		if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				n_chunk->filename = filename;
-				n_chunk->fileline = fileline;
-				n_chunk->lrc = calculateLRC(n_chunk);
-
-				ptr->next = n_chunk;
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences(n_chunk + 1, size);	
+		}
+		for (struct memory_mapping_t *mapping = mappings; mapping != NULL; mapping = mapping->next) {
+			if (mapping->chunk->size > max) {
+				max = mapping->chunk->size;
 			}
 		}
 	}
-	return NULL;
+	HEAP_UNLOCK(&memory_manager);
+	return max;
 }
-void* heap_malloc_zero_debug(size_t count, int fileline, const char* filename) {
-	size_t size = count;
-	if (memory_manager.memory_start == NULL || size < 1 || heap_validate() > 0) {
+void *set_fences(void *address, size_t size) {
+	if (address == NULL || size < 1) {
 		return NULL;
 	}
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		uint8_t *ptr_i = (uint8_t *)memory_manager.memory_start;
-		for (size_t i = 0 ; i < memory_manager.memory_size; ++i, ++ptr_i) {
-			// LEFT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				// WORD SIZE COND
-				if ((intptr_t)ptr_i % sizeof(void *) == 0) {
-					// RIGHT COND
-					if (memory_manager.memory_size - i < size + FEN_SIZE) {
-						void *req = custom_sbrk(size + FEN_SIZE - memory_manager.memory_size + i);
-						if (req == (void *) - 1) {
-							return NULL;
-						}
-						memory_manager.memory_size += size + FEN_SIZE - memory_manager.memory_size + i;
-					}
-					struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-					n_chunk->prev = NULL;
-					n_chunk->next = NULL;
-					n_chunk->size = size;
-					n_chunk->free = 0;
-					n_chunk->filename = filename;
-					n_chunk->fileline = fileline;
-					n_chunk->lrc = calculateLRC(n_chunk);
-					memory_manager.first_memory_chunk = n_chunk;
-					return set_fences_fill(n_chunk + 1, size);
-				}
-			}
-		}
+	memset(address, 0xFF, FEN_SIZE);
+	memset((uint8_t *)(address) + FEN_SIZE + size, 0xFF, FEN_SIZE);
+	return (void *)((uint8_t *)(address) + FEN_SIZE);
+}
+void *set_fences_fill(void *address, size_t size) {
+	if (address == NULL || size < 1) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// WORD SIZE COND
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				if (ptr->size >= size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->filename = filename;
-						a_chunk->fileline = fileline;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// WORD SIZE COND
-				if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-					// LEFT COND
-					if ((size_t)(ptr_i - (uint8_t *)(ptr + 1)) >= (size_t)((2*FEN_SIZE + 1) + sizeof(struct memory_chunk_t) + FEN_SIZE)) {
-						// RIGHT COND
-						if (ptr->size - i >= size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->filename = filename;
-							n_chunk->fileline = fileline;
-							n_chunk->free = 0;
-
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->filename = filename;
-								a_chunk->fileline = fileline;
-								a_chunk->lrc = calculateLRC(a_chunk);
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = a_chunk;
-							} else {
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-								n_chunk->next = ptr->next;
-							}
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->filename = filename;
-							ptr->fileline = fileline;
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1);
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences_fill(n_chunk + 1, size);
-						}
-					}
-				}
-			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// WORD SIZE COND
-		if ((intptr_t)(ptr_i) % sizeof(void *) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				n_chunk->prev = ptr;
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				n_chunk->filename = filename;
-				n_chunk->fileline = fileline;
-				n_chunk->lrc = calculateLRC(n_chunk);
-
-				ptr->next = n_chunk;
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences_fill(n_chunk + 1, size);	
+	memset(address, 0xFF, FEN_SIZE);
+	memset((uint8_t *)(address) + FEN_SIZE + size, 0xFF, FEN_SIZE);
+	memset((uint8_t *)(address) + FEN_SIZE, 0, size);
+	return (void *)((uint8_t *)(address) + FEN_SIZE);
+}
+void heap_free(void *address) {
+	// RECORDED FIRST, the address can be handed out again as soon as it's freed
+	if (trace_file != NULL && address != NULL) {
+		trace_record(trace_free, WORD_SIZE, address, NULL, 0);
+	}
+#ifdef HEAP_THREAD_SAFE
+	if (thread_cache_put(address)) {
+		return;
+	}
+#endif
+	HEAP_LOCK(&memory_manager);
+	release_block(&memory_manager, address);
+	HEAP_UNLOCK(&memory_manager);
+}
+// The heap is checked and trimmed once for the whole batch, NULL entries are skipped
+void heap_free_batch(void **blocks, size_t count) {
+	if (blocks == NULL) {
+		return;
+	}
+	for (size_t i = 0; trace_file != NULL && i < count; ++i) {
+		if (blocks[i] != NULL) {
+			trace_record(trace_free, WORD_SIZE, blocks[i], NULL, 0);
+		}
+	}
+	HEAP_LOCK(&memory_manager);
+	if ((memory_manager.first_memory_chunk != NULL || mappings != NULL) && heap_check(&memory_manager) == 0) {
+		for (size_t i = 0; i < count; ++i) {
+			if (blocks[i] != NULL) {
+				block_free(&memory_manager, blocks[i]);
 			}
 		}
+		trim_check(&memory_manager);
 	}
-	return NULL;
+	HEAP_UNLOCK(&memory_manager);
 }
-void* heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || size < 1 || number < 1 || heap_validate() > 0) {
-		return NULL;
-	}
-	return heap_malloc_zero_debug(number*size, fileline, filename);
+int heap_trim(size_t pad) {
+#ifdef HEAP_THREAD_SAFE
+	thread_cache_flush(NULL);
+#endif
+	HEAP_LOCK(&memory_manager);
+	size_t memory_size = memory_manager.memory_size;
+	if (memory_manager.memory_start != NULL && heap_check(&memory_manager) == 0) {
+		slab_release_empty(&memory_manager);
+		trim_top(&memory_manager, pad);
+	}
+	int status = memory_manager.memory_size < memory_size;
+	HEAP_UNLOCK(&memory_manager);
+	return status;
 }
-void* heap_realloc_debug(void* memblock, size_t size, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || heap_validate() > 0) {
+struct memory_manager_t *arena_create(size_t capacity) {
+	size_t header = (sizeof(struct memory_manager_t) + 2*WORD_SIZE - 1) & ~(2*WORD_SIZE - 1);
+	if (capacity < 1 || capacity > SIZE_MAX - header) {
 		return NULL;
 	}
-	if (memblock == NULL) {
-		return heap_malloc_debug(size, fileline, filename);
+#ifdef HEAP_COMPACT_HEADER
+	// SIZES AND LINKS OF A COMPACT CONTROL BLOCK ARE 32 BIT
+	if (capacity > UINT32_MAX) {
+		return NULL;
 	}
-	if (size == 0) {
-		heap_free(memblock);
+#endif
+	struct memory_manager_t *arena = heap_malloc(header + capacity);
+	if (arena == NULL) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(ptr != NULL) {
-		if (memblock == (void *)((uint8_t *)(ptr + 1) + FEN_SIZE)) {
-			// FREE BLOCK PTR
-			if (ptr->free == 1) {
-				return NULL;
-			}
-			if ((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) % sizeof(void *) == 0) {
-				size_t real_sum = ptr->size;
-				if (ptr->next != NULL) {
-					real_sum = (uint8_t *)ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t) - 2*FEN_SIZE;
-				}
-				// FITS
-				if (real_sum >= size) {
-					if (real_sum - size >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = real_sum - size - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->fileline = fileline;
-						a_chunk->filename = filename;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-							ptr->next = a_chunk;
-						}
-					}
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size - real_sum);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size - real_sum;
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// IF NEXT IS FREE
-				if (ptr->next != NULL && ptr->next->free == 1) {
-					size_t right_size = ptr->next->size;
-					if (ptr->next->next != NULL) {
-						right_size = (uint8_t *)ptr->next->next - (uint8_t *)ptr->next;
-					}
-					// IF IT HAS THE SPACE
-					if (right_size + real_sum >= size) {
-						if (ptr->next->next != NULL) {
-							ptr->next->next->prev = ptr;
-							ptr->next->next->lrc = calculateLRC(ptr->next->next);
-						}
-						ptr->fileline = fileline;
-						ptr->filename = filename;
-						ptr->next = ptr->next->next;
-						ptr->size = size;
-						ptr->lrc = calculateLRC(ptr);
-						return set_fences(ptr + 1, size);
-					}
-				}
-			}
-			// ADD NEW BLOCK CASE
-			uint8_t *req = heap_malloc_debug(size, fileline, filename);
-			if (req == NULL) {
-				return NULL;
-			}
-			memcpy(req, memblock, ptr->size);
-			heap_free(memblock);
-			return req;
-		}
-		ptr = ptr->next;
+	manager_init(arena, (uint8_t *)arena + header, 0, capacity);
+#ifdef HEAP_THREAD_SAFE
+	pthread_mutex_init(&arena->lock, NULL);
+#endif
+	return arena;
+}
+void arena_destroy(struct memory_manager_t *arena) {
+	if (arena == NULL) {
+		return;
 	}
-	// INVAID PTR
-	return NULL;
+#ifdef HEAP_THREAD_SAFE
+	pthread_mutex_destroy(&arena->lock);
+#endif
+	heap_free(arena);
 }
-void* heap_malloc_aligned_debug(size_t count, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || count < 1 || heap_validate() > 0) {
+void *arena_malloc(struct memory_manager_t *arena, size_t size) {
+	if (arena == NULL) {
 		return NULL;
 	}
-	int size = count;
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		// ALLOC NEW BLOCK
-		if (memory_manager.memory_size < (size_t)(PAGE_SIZE + size + FEN_SIZE)) {
-			void *request = custom_sbrk(PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size);
-			if (request == (void *) - 1) {
-				return NULL;
-			}
-			memory_manager.memory_size += PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size;
-		}
-		struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)((uint8_t *)memory_manager.memory_start + PAGE_SIZE - sizeof(struct memory_chunk_t) - FEN_SIZE);
-		n_chunk->next = NULL;
-		n_chunk->size = size;
-		n_chunk->free = 0;
-		n_chunk->fileline = fileline;
-		n_chunk->filename = filename;
-		
-		// ALLOC FREE BLOCK
-		struct memory_chunk_t *b_chunk = (struct memory_chunk_t *)memory_manager.memory_start;
-		b_chunk->prev = NULL;
-		b_chunk->size = (size_t)((uint8_t *)n_chunk - (uint8_t *)b_chunk - sizeof(struct memory_chunk_t));
-		b_chunk->free = 1;
-		b_chunk->fileline = fileline;
-		b_chunk->filename = filename;
-
-
-		// CORRECT PTRS & LRCs
-		b_chunk->next = n_chunk;
-		n_chunk->prev = b_chunk;
-		b_chunk->lrc = calculateLRC(b_chunk);
-		n_chunk->lrc = calculateLRC(n_chunk);
-
-		memory_manager.first_memory_chunk = b_chunk;
-		return set_fences(n_chunk + 1, size);
+	HEAP_LOCK(arena);
+	void *block = allocate_block(arena, size, WORD_SIZE, 0, 0, NULL);
+	HEAP_UNLOCK(arena);
+	return block;
+}
+void *arena_realloc(struct memory_manager_t *arena, void *memblock, size_t size) {
+	if (arena == NULL) {
+		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// PAGE COND
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				if (ptr->size >= (size_t)size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->fileline = fileline;
-						a_chunk->filename = filename;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// PAGE COND
-				if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-					// LEFT COND
-					if (i >= (size_t)(3*FEN_SIZE + sizeof(struct memory_chunk_t) + 1)) {
-						// RIGHT COND
-						if (ptr->size - i >= (size_t)size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->fileline = fileline;
-								a_chunk->filename = filename;
-								a_chunk->lrc = calculateLRC(a_chunk);
-								
-								n_chunk->next = a_chunk;
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							} else {
-								n_chunk->next = ptr->next;
-								
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							}
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1) - sizeof(struct memory_chunk_t) - FEN_SIZE;
-							
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-							n_chunk->fileline = fileline;
-							n_chunk->filename = filename;
-							
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->fileline = fileline;
-							ptr->filename = filename;
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences(n_chunk + 1, size);
-						}
-					}
-				}
-			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// PAGE COND
-		if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				struct memory_chunk_t *a_chunk  = custom_sbrk(0);
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				n_chunk->fileline = fileline;
-				n_chunk->filename = filename;
-				n_chunk->prev = ptr;	
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				ptr->next = n_chunk;
-				ptr->fileline = fileline;
-				ptr->filename = filename;
-				// NEW BLOCK CASE
-				if (i - FEN_SIZE - sizeof(struct memory_chunk_t) >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-					a_chunk->prev = ptr;
-					a_chunk->next = n_chunk;
-					a_chunk->size = i - 2*sizeof(struct memory_chunk_t) - 3*FEN_SIZE;
-					a_chunk->free = 1;
-					a_chunk->fileline = fileline;
-					a_chunk->filename = filename;
-					a_chunk->lrc = calculateLRC(a_chunk);
-
-					n_chunk->prev = a_chunk;
-					ptr->next = a_chunk;
-				}
-				n_chunk->lrc = calculateLRC(n_chunk);
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences(n_chunk + 1, size);	
-			}
-		}
+	HEAP_LOCK(arena);
+	void *block = reallocate_block(arena, memblock, size, WORD_SIZE, 0, NULL);
+	HEAP_UNLOCK(arena);
+	return block;
+}
+void arena_free(struct memory_manager_t *arena, void *address) {
+	if (arena == NULL) {
+		return;
 	}
-	return NULL;
+	HEAP_LOCK(arena);
+	release_block(arena, address);
+	HEAP_UNLOCK(arena);
 }
-void* heap_malloc_aligned_zero_debug(size_t count, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || count < 1 || heap_validate() > 0) {
-		return NULL;
+void arena_stats(struct memory_manager_t *arena, struct heap_stats_t *stats) {
+	if (arena != NULL && stats != NULL) {
+		manager_stats(arena, stats);
 	}
-	int size = count;
-
-	// FREE MEM CASE
-	if (memory_manager.first_memory_chunk == NULL) {
-		// ALLOC NEW BLOCK
-		if (memory_manager.memory_size < (size_t)(PAGE_SIZE + size + FEN_SIZE)) {
-			void *request = custom_sbrk(PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size);
-			if (request == (void *) - 1) {
-				return NULL;
-			}
-			memory_manager.memory_size += PAGE_SIZE + size + FEN_SIZE - memory_manager.memory_size;
-		}
-		struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)((uint8_t *)memory_manager.memory_start + PAGE_SIZE - sizeof(struct memory_chunk_t) - FEN_SIZE);
-		n_chunk->next = NULL;
-		n_chunk->size = size;
-		n_chunk->free = 0;
-		n_chunk->fileline = fileline;
-		n_chunk->filename = filename;
-		
-		// ALLOC FREE BLOCK
-		struct memory_chunk_t *b_chunk = (struct memory_chunk_t *)memory_manager.memory_start;
-		b_chunk->prev = NULL;
-		b_chunk->size = (size_t)((uint8_t *)n_chunk - (uint8_t *)b_chunk - sizeof(struct memory_chunk_t));
-		b_chunk->free = 1;
-		b_chunk->fileline = fileline;
-		b_chunk->filename = filename;
-
-
-		// CORRECT PTRS & LRCs
-		b_chunk->next = n_chunk;
-		n_chunk->prev = b_chunk;
-		b_chunk->lrc = calculateLRC(b_chunk);
-		n_chunk->lrc = calculateLRC(n_chunk);
-
-		memory_manager.first_memory_chunk = b_chunk;
-		return set_fences_fill(n_chunk + 1, size);
+}
+void arena_get_fragmentation(struct memory_manager_t *arena, struct heap_fragmentation_t *fragmentation) {
+	if (arena != NULL && fragmentation != NULL) {
+		manager_fragmentation(arena, fragmentation);
 	}
+}
+// Full pass over the heap, the free path already keeps neighbouring free chunks merged
+void merge_chunks(void) {
+	HEAP_LOCK(&memory_manager);
 	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(1) {
-		// FREE BLOCK CASE
-		if (ptr->free) {
-			// PAGE COND
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				if (ptr->size >= (size_t)size + 2*FEN_SIZE) {
-					// ADD BLOCK COND
-					if (ptr->size >= size + 2*FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = ptr->size - size - 2*FEN_SIZE - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->fileline = fileline;
-						a_chunk->filename = filename;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-						}
-						ptr->next = a_chunk;
-					}
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size + 2*FEN_SIZE - ptr->size);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size + 2*FEN_SIZE - ptr->size;
-					ptr->fileline = fileline;
-					ptr->filename = filename;
-					ptr->size = size;
-					ptr->free = 0;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences_fill(ptr + 1, size);
-				}
-			}
-			// SPLIT CASE NEXT BLOCK
-			uint8_t *ptr_i = (uint8_t *)(ptr + 1);
-			for (size_t i = 0 ; i < ptr->size; ++i, ++ptr_i) {
-				// PAGE COND
-				if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-					// LEFT COND
-					if (i >= (size_t)(3*FEN_SIZE + sizeof(struct memory_chunk_t) + 1)) {
-						// RIGHT COND
-						if (ptr->size - i >= (size_t)size + FEN_SIZE) {
-							struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)(ptr_i + FEN_SIZE + size);
-							struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-							// ADD BLOCK COND
-							if (ptr->size - i >= size + FEN_SIZE + sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-								a_chunk->prev = n_chunk;
-								a_chunk->next = ptr->next;
-								a_chunk->size = ptr->size - i - size - FEN_SIZE - sizeof(struct memory_chunk_t);
-								a_chunk->free = 1;
-								a_chunk->fileline = fileline;
-								a_chunk->filename = filename;
-								a_chunk->lrc = calculateLRC(a_chunk);
-								
-								n_chunk->next = a_chunk;
-
-								if (ptr->next != NULL) {
-									ptr->next->prev = a_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							} else {
-								n_chunk->next = ptr->next;
-								
-								if (ptr->next != NULL) {
-									ptr->next->prev = n_chunk;
-									ptr->next->lrc = calculateLRC(ptr->next);
-								}
-							}
-							ptr->next = n_chunk;
-							ptr->size = ptr_i - (uint8_t *)(ptr + 1) - sizeof(struct memory_chunk_t) - FEN_SIZE;
-							
-							n_chunk->prev = ptr;
-							n_chunk->size = size;
-							n_chunk->free = 0;
-							n_chunk->fileline = fileline;
-							n_chunk->filename = filename;
-							
-							n_chunk->lrc = calculateLRC(n_chunk);
-							ptr->fileline = fileline;
-							ptr->filename = filename;
-							ptr->lrc = calculateLRC(ptr);
-
-							return set_fences_fill(n_chunk + 1, size);
-						}
-					}
-				}
-			}
- 		}
- 		if (ptr->next == NULL) {
- 			break;
- 		}
-		ptr = ptr->next;
-	}
-	uint8_t *ptr_i = custom_sbrk(0);
-	for (size_t i = 0 ; ; ++i, ++ptr_i) {
-		// PAGE COND
-		if (((intptr_t)(ptr_i) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-			// STRCT COND
-			if (i >= sizeof(struct memory_chunk_t) + FEN_SIZE) {
-				struct memory_chunk_t *n_chunk = (struct memory_chunk_t *)(ptr_i - sizeof(struct memory_chunk_t) - FEN_SIZE);
-				struct memory_chunk_t *a_chunk  = custom_sbrk(0);
-				void *req = custom_sbrk(size + FEN_SIZE + i);
-				if (req == (void *) - 1) {
-					return NULL;
-				}
-				memory_manager.memory_size += size + FEN_SIZE + i;
-				n_chunk->fileline = fileline;
-				n_chunk->filename = filename;
-				n_chunk->prev = ptr;	
-				n_chunk->next = NULL;
-				n_chunk->size = size;
-				n_chunk->free = 0;
-				ptr->next = n_chunk;
-				ptr->fileline = fileline;
-				ptr->filename = filename;
-				// NEW BLOCK CASE
-				if (i - FEN_SIZE - sizeof(struct memory_chunk_t) >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-					a_chunk->prev = ptr;
-					a_chunk->next = n_chunk;
-					a_chunk->size = i - 2*sizeof(struct memory_chunk_t) - 3*FEN_SIZE;
-					a_chunk->free = 1;
-					a_chunk->fileline = fileline;
-					a_chunk->filename = filename;
-					a_chunk->lrc = calculateLRC(a_chunk);
+	while (ptr != NULL) {
+		if (ptr->free && chunk_next(ptr) != NULL && chunk_next(ptr)->free) {
+			bin_remove(&memory_manager, ptr);
+			ptr = chunk_coalesce(&memory_manager, ptr);
+		}
+		ptr = chunk_next(ptr);
+	}
+	HEAP_UNLOCK(&memory_manager);
+}
 
-					n_chunk->prev = a_chunk;
-					ptr->next = a_chunk;
-				}
-				n_chunk->lrc = calculateLRC(n_chunk);
-				ptr->lrc = calculateLRC(ptr);
-				return set_fences_fill(n_chunk + 1, size);	
+// Computed over a copy of the control block with the checksum field cleared
+heap_checksum_t calculateLRC(struct memory_chunk_t *ptr) {
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_LRC
+	struct memory_chunk_t header;
+	memcpy(&header, ptr, sizeof(header));
+	header.lrc = 0;
+	uint8_t LRC = 0;
+	for (size_t i = 0; i < sizeof(header); ++i) {
+		LRC = (LRC + *((uint8_t *)&header + i)) & 0xFF;
+	}
+	return ((LRC ^ 0xFF) + 1) & 0xFF;
+#else
+	uint32_t words[sizeof(struct memory_chunk_t) / sizeof(uint32_t)];
+	memcpy(words, ptr, sizeof(words));
+	memset((uint8_t *)words + offsetof(struct memory_chunk_t, lrc), 0, sizeof(heap_checksum_t));
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_CRC32C
+	uint32_t sum = ~(uint32_t)0;
+	for (size_t i = 0; i < sizeof(words) / sizeof(uint32_t); ++i) {
+		sum = CRC32C_WORD(sum, words[i]);
+	}
+	sum = ~sum;
+#else
+	// Multiply-xor over pairs of words in two lanes, so the multiplications don't wait on each other
+	uint64_t lane1 = 0x9E3779B97F4A7C15ull;
+	uint64_t lane2 = 0xC2B2AE3D27D4EB4Full;
+	for (size_t i = 0; i + 1 < sizeof(words) / sizeof(uint32_t); i += 2) {
+		lane1 = (lane1 ^ words[i]) * 0xFF51AFD7ED558CCDull;
+		lane2 = (lane2 ^ words[i + 1]) * 0xC4CEB9FE1A85EC53ull;
+	}
+	if (sizeof(words) / sizeof(uint32_t) % 2 != 0) {
+		lane1 = (lane1 ^ words[sizeof(words) / sizeof(uint32_t) - 1]) * 0xFF51AFD7ED558CCDull;
+	}
+	uint64_t hash = lane1 ^ (lane2 >> 29 | lane2 << 35);
+	uint32_t sum = (uint32_t)(hash ^ hash >> 32);
+#endif
+#ifdef HEAP_COMPACT_HEADER
+	sum ^= sum >> 16;
+	sum ^= sum >> 8;
+#endif
+	return (heap_checksum_t)sum;
+#endif
+}
+static int validate_chunks(struct memory_manager_t *manager) {
+	if (manager->memory_start == NULL) {
+		return 2;
+	}
+	// CHECK ALL LRC & FENCES
+	for (struct memory_chunk_t *ptr = manager->first_memory_chunk; ptr != NULL; ptr = chunk_next(ptr)) {
+		int status = chunk_validate(ptr);
+		if (status != 0) {
+			return status;
+		}
+	}
+	if (manager == &memory_manager) {
+		for (struct memory_mapping_t *mapping = mappings; mapping != NULL; mapping = mapping->next) {
+			int status = chunk_validate(mapping->chunk);
+			if (status != 0) {
+				return status;
 			}
 		}
 	}
-	return NULL;
+	return 0;
 }
-void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || size < 1 || number < 1 || heap_validate() > 0) {
+int heap_validate(void) {
+	HEAP_LOCK(&memory_manager);
+	int status = validate_chunks(&memory_manager);
+	HEAP_UNLOCK(&memory_manager);
+	return status;
+}
+
+void* heap_malloc_aligned(size_t count) {
+	return heap_allocate(count, PAGE_SIZE, 0, 0, NULL);
+}
+void* heap_malloc_aligned_zero(size_t count) {
+	return heap_allocate(count, PAGE_SIZE, 1, 0, NULL);
+}
+void* heap_calloc_aligned(size_t number, size_t size) {
+	if (memory_manager.memory_start == NULL || size < 1 || number < 1) {
 		return NULL;
 	}
-	return heap_malloc_aligned_zero_debug(number*size, fileline, filename);
+	return heap_malloc_aligned_zero(number*size);
 }
-void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename) {
-	if (memory_manager.memory_start == NULL || heap_validate() > 0) {
+void* heap_realloc_aligned(void* memblock, size_t size) {
+	return heap_reallocate(memblock, size, PAGE_SIZE, 0, NULL);
+}
+
+// Alignment must be a power of two, anything below a word is rounded up to a word. Alignments
+// above MAX_BLOCK_SIZE are refused with the sizes, so placing a block can't wrap around
+static size_t memalign_alignment(size_t alignment) {
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_BLOCK_SIZE) {
+		return 0;
+	}
+	return alignment < WORD_SIZE ? WORD_SIZE : alignment;
+}
+void* heap_memalign(size_t alignment, size_t size) {
+	alignment = memalign_alignment(alignment);
+	if (alignment == 0) {
 		return NULL;
 	}
-	if (memblock == NULL) {
-		return heap_malloc_aligned_debug(size, fileline, filename);
+	return heap_allocate(size, alignment, 0, 0, NULL);
+}
+void* heap_aligned_alloc(size_t alignment, size_t size) {
+	return heap_memalign(alignment, size);
+}
+void* heap_realloc_memalign(void* memblock, size_t alignment, size_t size) {
+	alignment = memalign_alignment(alignment);
+	if (alignment == 0) {
+		return NULL;
 	}
-	if (size == 0) {
-		heap_free(memblock);
+	return heap_reallocate(memblock, size, alignment, 0, NULL);
+}
+
+void* heap_malloc_debug(size_t count, int fileline, const char* filename) {
+	return heap_allocate(count, WORD_SIZE, 0, fileline, filename);
+}
+void* heap_malloc_zero_debug(size_t count, int fileline, const char* filename) {
+	return heap_allocate(count, WORD_SIZE, 1, fileline, filename);
+}
+void* heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename) {
+	if (memory_manager.memory_start == NULL || size < 1 || number < 1) {
 		return NULL;
 	}
-	struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
-	while(ptr != NULL) {
-		if (memblock == (void *)((uint8_t *)(ptr + 1) + FEN_SIZE)) {
-			// FREE BLOCK PTR
-			if (ptr->free == 1) {
-				return NULL;
-			}
-			if (((intptr_t)((uint8_t *)(ptr + 1) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
-				size_t real_sum = ptr->size;
-				if (ptr->next != NULL) {
-					real_sum = (uint8_t *)ptr->next - (uint8_t *)ptr - sizeof(struct memory_chunk_t) - 2*FEN_SIZE;
-				}
-				// FITS
-				if (real_sum >= size) {
-					if (real_sum - size >= sizeof(struct memory_chunk_t) + 2*FEN_SIZE + 1) {
-						struct memory_chunk_t *a_chunk  = (struct memory_chunk_t *)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + size + 2*FEN_SIZE);
-						a_chunk->prev = ptr;
-						a_chunk->next = ptr->next;
-						a_chunk->size = real_sum - size - sizeof(struct memory_chunk_t);
-						a_chunk->free = 1;
-						a_chunk->filename = filename;
-						a_chunk->fileline = fileline;
-						a_chunk->lrc = calculateLRC(a_chunk);
-						if (ptr->next != NULL) {
-							ptr->next->prev = a_chunk;
-							ptr->next->lrc = calculateLRC(ptr->next);
-							ptr->next = a_chunk;
-						}
-					}
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// EXPAND LAST BLOCK CASE
-				if (ptr->next == NULL) {
-					void *req = custom_sbrk(size - real_sum);
-					if (req == (void *) - 1) {
-						return NULL;
-					}
-					memory_manager.memory_size += size - real_sum;
-					ptr->filename = filename;
-					ptr->fileline = fileline;
-					ptr->size = size;
-					ptr->lrc = calculateLRC(ptr);
-					return set_fences(ptr + 1, size);
-				}
-				// IF NEXT IS FREE
-				if (ptr->next != NULL && ptr->next->free == 1) {
-					size_t right_size = ptr->next->size;
-					if (ptr->next->next != NULL) {
-						right_size = (uint8_t *)ptr->next->next - (uint8_t *)ptr->next;
-					}
-					// IF IT HAS THE SPACE
-					if (right_size + real_sum >= size) {
-						if (ptr->next->next != NULL) {
-							ptr->next->next->prev = ptr;
-							ptr->next->next->lrc = calculateLRC(ptr->next->next);
-						}
-						ptr->filename = filename;
-						ptr->fileline = fileline;
-						ptr->next = ptr->next->next;
-						ptr->size = size;
-						ptr->lrc = calculateLRC(ptr);
-						return set_fences(ptr + 1, size);
-					}
-				}
-			}
-			// ADD NEW BLOCK CASE
-			uint8_t *req = heap_malloc_aligned_debug(size, fileline, filename);
-			if (req == NULL) {
-				return NULL;
-			}
-			memcpy(req, memblock, ptr->size);
-			heap_free(memblock);
-			return req;
-		}
-		ptr = ptr->next;
+	return heap_malloc_zero_debug(number*size, fileline, filename);
+}
+void* heap_realloc_debug(void* memblock, size_t size, int fileline, const char* filename) {
+	return heap_reallocate(memblock, size, WORD_SIZE, fileline, filename);
+}
+void* heap_malloc_aligned_debug(size_t count, int fileline, const char* filename) {
+	return heap_allocate(count, PAGE_SIZE, 0, fileline, filename);
+}
+void* heap_malloc_aligned_zero_debug(size_t count, int fileline, const char* filename) {
+	return heap_allocate(count, PAGE_SIZE, 1, fileline, filename);
+}
+void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename) {
+	if (memory_manager.memory_start == NULL || size < 1 || number < 1) {
+		return NULL;
 	}
-	// INVAID PTR
-	return NULL;
+	return heap_malloc_aligned_zero_debug(number*size, fileline, filename);
+}
+void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename) {
+	return heap_reallocate(memblock, size, PAGE_SIZE, fileline, filename);
 }
 void print_mem(void) {
+	HEAP_LOCK(&memory_manager);
 	if (memory_manager.first_memory_chunk != NULL) {
 		struct memory_chunk_t* ptr = memory_manager.first_memory_chunk;
 		size_t i = 0;
@@ -1995,24 +2360,25 @@ void print_mem(void) {
 			if (((intptr_t)((uint8_t *)ptr + sizeof(struct memory_chunk_t) + FEN_SIZE) & (intptr_t)(PAGE_SIZE - 1)) == 0) {
 				page_num++;
 			}
-			if (ptr->prev == NULL) {
+			if (chunk_prev(ptr) == NULL) {
 				printf("\t----------START----------\n");
 			}
 			printf("\t    ╔═══════════════════════╗\n");
 			printf("\t    ║       Block %4zu      ║\n", i);
 			printf("\t    ║Page num :        %5zu║\n", page_num);
 			printf("\t    ║Free     :        %5s║\n", ptr->free ? "Yes" : "No");
-			printf("\t    ║Size     :        %4zuB║\n", ptr->size);
-			printf("\t    ║Real size:        %4zuB║\n", ptr->next ? (size_t)((uint8_t*)ptr->next - (uint8_t*)ptr) : (ptr->free ? ptr->size + sizeof(struct memory_chunk_t) : ptr->size + sizeof(struct memory_chunk_t) + 2*FEN_SIZE));
-			printf("\t    ║LRC      :         0x%02x║\n", ptr->lrc);
-			printf("\t    ║Filename :   %10s║\n", ptr->filename);
-			printf("\t    ║Fileline :        %5d║\n", ptr->fileline);
+			printf("\t    ║Size     :        %4zuB║\n", (size_t)ptr->size);
+			printf("\t    ║Real size:        %4zuB║\n", chunk_next(ptr) ? (size_t)((uint8_t*)chunk_next(ptr) - (uint8_t*)ptr) : (size_t)(ptr->free ? ptr->size + sizeof(struct memory_chunk_t) : ptr->size + sizeof(struct memory_chunk_t) + 2*FEN_SIZE));
+			printf("\t    ║LRC      :%*s0x%0*x║\n", (int)(11 - 2*sizeof(heap_checksum_t)), "", (int)(2*sizeof(heap_checksum_t)), (unsigned int)ptr->lrc);
+			printf("\t    ║Filename :   %10s║\n", chunk_filename(ptr));
+			printf("\t    ║Fileline :        %5d║\n", chunk_fileline(ptr));
 			printf("\t    ╚═══════════════════════╝\n");
-			if (ptr->next == NULL) {
+			if (chunk_next(ptr) == NULL) {
 				printf("\t----------STOP----------\n");
 			}
-			ptr = ptr->next;
+			ptr = chunk_next(ptr);
 			i++;
 		}
 	}
-}
\ No newline at end of file
+	HEAP_UNLOCK(&memory_manager);
+}
@@ -1,7 +1,25 @@
 #ifndef __HEAP_H__
 #define __HEAP_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#ifdef HEAP_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#define BIN_COUNT 256
+
+// Blocks of up to HEAP_SLAB_MAX_SIZE bytes are carved from slabs, 0 disables them. The thread
+// cache already serves small blocks in the thread-safe build, so slabs are off there
+#ifndef HEAP_SLAB_MAX_SIZE
+#ifdef HEAP_THREAD_SAFE
+#define HEAP_SLAB_MAX_SIZE 0
+#else
+#define HEAP_SLAB_MAX_SIZE 128
+#endif
+#endif
+#define SLAB_CLASS   8
+#define SLAB_CLASSES (HEAP_SLAB_MAX_SIZE / SLAB_CLASS)
 
 enum pointer_type_t {
 	pointer_null,
@@ -12,20 +30,145 @@ enum pointer_type_t {
 	pointer_unallocated,
 	pointer_valid
 };
+enum validation_level_t {
+	validation_off,
+	validation_sampled,
+	validation_local,
+	validation_full
+};
+// A trace starts with HEAP_TRACE_MAGIC and two 32 bit words, the record size and 0, followed by
+// one record per call. Time is in nanoseconds since the trace was started, size_op packs the
+// requested size, the log2 of the alignment and the operation
+#define HEAP_TRACE_MAGIC "HEAPTRC1"
+enum heap_trace_op_t {
+	trace_malloc,
+	trace_calloc,
+	trace_realloc,
+	trace_free
+};
+struct heap_trace_record_t {
+	uint64_t time;
+	uint64_t address;
+	uint64_t result;
+	uint64_t size_op;
+};
+#define HEAP_TRACE_OP(record)        ((enum heap_trace_op_t)((record)->size_op & 0xFF))
+#define HEAP_TRACE_ALIGNMENT(record) ((size_t)1 << (((record)->size_op >> 8) & 0xFF))
+#define HEAP_TRACE_SIZE(record)      ((size_t)((record)->size_op >> 16))
+
+// Where a block is placed among the free chunks: the first chunk that fits in the smallest
+// non-empty size class, the next chunk that fits after the last one used, or the smallest chunk
+// that fits
+enum heap_placement_t {
+	placement_segregated,
+	placement_next_fit,
+	placement_best_fit
+};
+// Growth and trimming policy of the heap, see heap_set_config()
+struct heap_config_t {
+	size_t grow_min;
+	unsigned int grow_percent;
+	size_t grow_granularity;
+	size_t trim_threshold;
+	size_t mmap_threshold;
+	// Read by heap_setup() and arena_create(), a running heap keeps its policy
+	enum heap_placement_t placement;
+};
+// Snapshot of the counters of a heap, see heap_stats(). A slab counts as one used block holding
+// the bytes of its objects, blocks held by thread caches count as used
+struct heap_stats_t {
+	size_t heap_size;
+	size_t peak_heap_size;
+	size_t mapped_size;
+	size_t used_bytes;
+	size_t peak_used_bytes;
+	size_t free_bytes;
+	size_t overhead_bytes;
+	size_t used_blocks;
+	size_t free_blocks;
+	size_t mapped_blocks;
+	size_t sbrk_calls;
+};
+// Free space of a heap, see heap_get_fragmentation(). Class i of the histogram counts the free
+// blocks of 2^i up to 2^(i+1) - 1 bytes, the last class everything bigger. The external
+// fragmentation is the share of the free bytes that a single block can't use, 1 - largest / free
+#define HEAP_FREE_CLASSES 32
+struct heap_fragmentation_t {
+	size_t free_bytes;
+	size_t free_blocks;
+	size_t largest_free_block;
+	double external_fragmentation;
+	size_t histogram[HEAP_FREE_CLASSES];
+};
+// The main heap and every arena are managed by one of these
 struct memory_manager_t {
 	void *memory_start;
 	size_t memory_size;
+	// Capacity of an arena, 0 for the main heap which grows with custom_sbrk
+	size_t memory_limit;
 	struct memory_chunk_t *first_memory_chunk;
+	struct memory_chunk_t *last_memory_chunk;
+	// Segregated free lists, bin_map marks the non-empty ones
+	struct memory_chunk_t *bins[BIN_COUNT];
+	uint64_t bin_map[BIN_COUNT / 64];
+	// Largest size in each bin and the number of chunks of that size. A count of 0 in a non-empty
+	// bin means its largest chunks have left and it has to be looked at again
+	size_t bin_max[BIN_COUNT];
+	size_t bin_max_count[BIN_COUNT];
+	// Free chunks are kept in the bins, or in a tree ordered by size and address for best fit.
+	// Next fit resumes its search at the rover
+	enum heap_placement_t placement;
+	struct memory_chunk_t *free_tree;
+	struct memory_chunk_t *free_tree_max;
+	struct memory_chunk_t *rover;
+	// Slabs with free objects, one list per size class
+	struct memory_slab_t *slabs[SLAB_CLASSES > 0 ? SLAB_CLASSES : 1];
+	// Kept up to date by every change of the heap, so heap_stats() doesn't walk it
+	struct heap_stats_t stats;
+	size_t chunk_count;
+	size_t free_histogram[HEAP_FREE_CLASSES];
+	unsigned int validation_counter;
+#ifdef HEAP_THREAD_SAFE
+	pthread_mutex_t lock;
+#endif
 };
+// Checksum of the control blocks, chosen at build time with -DHEAP_CHECKSUM=<algorithm>. The
+// LRC takes 8 bits, the others 32 bits or 8 bits folded from them in the compact layout
+#define HEAP_CHECKSUM_LRC    0
+#define HEAP_CHECKSUM_HASH   1
+#define HEAP_CHECKSUM_CRC32C 2
+#ifndef HEAP_CHECKSUM
+#define HEAP_CHECKSUM HEAP_CHECKSUM_HASH
+#endif
+#if HEAP_CHECKSUM == HEAP_CHECKSUM_LRC || defined(HEAP_COMPACT_HEADER)
+typedef uint8_t heap_checksum_t;
+#else
+typedef uint32_t heap_checksum_t;
+#endif
+
+#ifdef HEAP_COMPACT_HEADER
+// Links are distances in bytes to the neighbouring control blocks (0 when there is none) and the
+// file and line of debug blocks are kept in a side table, so a control block takes 16 bytes
+// instead of 48. The heap is limited to 4 GiB in this mode
+struct memory_chunk_t {
+	uint32_t prev;
+	uint32_t next;
+	uint32_t size;
+	uint8_t free;
+	heap_checksum_t lrc;
+	uint16_t site;
+};
+#else
 struct memory_chunk_t {
 	struct memory_chunk_t* prev;
 	struct memory_chunk_t* next;
 	size_t size;
 	int free;
-	uint8_t lrc;
+	heap_checksum_t lrc;
 	const char* filename;
 	int fileline;
 };
+#endif
 
 
 enum pointer_type_t get_pointer_type(const void* const pointer);
@@ -41,16 +184,31 @@ size_t heap_get_largest_used_block_size(void);
 void *set_fences(void *address, size_t size);
 void *set_fences_fill(void *address, size_t size);
 void heap_free(void *address);
+int heap_malloc_batch(size_t size, size_t count, void **blocks);
+void heap_free_batch(void **blocks, size_t count);
+int heap_trace_start(const char *path);
+void heap_trace_stop(void);
 void merge_chunks(void);
 
-uint8_t calculateLRC(struct memory_chunk_t *ptr);
+heap_checksum_t calculateLRC(struct memory_chunk_t *ptr);
 int heap_validate(void);
+void heap_set_validation(enum validation_level_t level, unsigned int sample_rate);
+int heap_trim(size_t pad);
+void heap_set_trim_threshold(size_t threshold);
+void heap_get_config(struct heap_config_t *config);
+int heap_set_config(const struct heap_config_t *config);
+void heap_stats(struct heap_stats_t *stats);
+void heap_get_fragmentation(struct heap_fragmentation_t *fragmentation);
 
 void* heap_malloc_aligned(size_t count);       
 void* heap_malloc_aligned_zero(size_t count);
 void* heap_calloc_aligned(size_t number, size_t size);    
 void* heap_realloc_aligned(void* memblock, size_t size);
 
+void* heap_memalign(size_t alignment, size_t size);
+void* heap_aligned_alloc(size_t alignment, size_t size);
+void* heap_realloc_memalign(void* memblock, size_t alignment, size_t size);
+
 void* heap_malloc_debug(size_t count, int fileline, const char* filename);
 void* heap_malloc_zero_debug(size_t count, int fileline, const char* filename);
 void* heap_calloc_debug(size_t number, size_t size, int fileline, const char* filename);
@@ -61,6 +219,14 @@ void* heap_malloc_aligned_zero_debug(size_t count, int fileline, const char* fil
 void* heap_calloc_aligned_debug(size_t number, size_t size, int fileline, const char* filename);
 void* heap_realloc_aligned_debug(void* memblock, size_t size, int fileline, const char* filename);
 
+struct memory_manager_t *arena_create(size_t capacity);
+void arena_destroy(struct memory_manager_t *arena);
+void *arena_malloc(struct memory_manager_t *arena, size_t size);
+void *arena_realloc(struct memory_manager_t *arena, void *memblock, size_t size);
+void arena_free(struct memory_manager_t *arena, void *address);
+void arena_stats(struct memory_manager_t *arena, struct heap_stats_t *stats);
+void arena_get_fragmentation(struct memory_manager_t *arena, struct heap_fragmentation_t *fragmentation);
+
 void print_mem(void);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "heap.h"
+#include "custom_unistd.h"
 
 #define TEST_SIZE 8181
 #define TEST_PAGE_SIZE 4096
@@ -142,6 +144,110 @@ int main() {
 
 	assert(heap_get_largest_used_block_size() == 0);
 
+	// GROWTH OF THE LAST BLOCK THAT CAN'T BE MET LEAVES THE HEAP INTACT
+	struct heap_config_t config;
+	heap_get_config(&config);
+	size_t mmap_threshold = config.mmap_threshold;
+	config.mmap_threshold = 0;
+	heap_set_config(&config);
+	char *block = heap_malloc(1000);
+	heap_free(heap_malloc(5000));
+	assert(heap_realloc(block, (size_t)80 << 20) == NULL);
+	assert(heap_validate() == 0);
+	block = heap_realloc(block, 3000);
+	assert(block != NULL && heap_validate() == 0);
+	config.mmap_threshold = mmap_threshold;
+	heap_set_config(&config);
+	// THROUGH A MAPPING IT SUCCEEDS
+	block = heap_realloc(block, (size_t)80 << 20);
+	assert(block != NULL && heap_validate() == 0);
+	heap_free(block);
+
+	// ALIGNMENTS NO BLOCK CAN MEET ARE REFUSED
+	for (int shift = 40; shift < 64; ++shift) {
+		assert(heap_memalign((size_t)1 << shift, 16) == NULL);
+		assert(heap_aligned_alloc((size_t)1 << shift, 16) == NULL);
+	}
+	block = heap_malloc(100);
+	assert(heap_realloc_memalign(block, (size_t)1 << 63, 200) == NULL);
+	assert(heap_validate() == 0);
+	heap_free(block);
+
+	// SMALL BLOCKS REPORT THE SIZE THEY WERE ASKED FOR AND LEAVE NOTHING IN USE ONCE FREED
+	for (int j = 0; j < TEST_SIZE; ++j)
+		ptr[j] = heap_malloc(j % 128 + 1);
+	for (int j = 0; j < TEST_SIZE; ++j)
+		if (j != 12)
+			heap_free(ptr[j]);
+#ifdef HEAP_THREAD_SAFE
+	// THREAD CACHES ROUND SMALL BLOCKS UP TO THEIR CLASS
+	assert(heap_get_largest_used_block_size() == 16);
+#else
+	assert(heap_get_largest_used_block_size() == 13);
+#endif
+	heap_free(ptr[12]);
+	assert(heap_get_largest_used_block_size() == 0);
+	struct heap_stats_t stats;
+	heap_stats(&stats);
+	assert(stats.used_bytes == 0);
+	assert(stats.heap_size < config.trim_threshold);
+
+	// FORGED AND STALE POINTERS ARE NOT TAKEN BACK
+	char *outer = heap_malloc(400);
+	char *inner = heap_malloc(160);
+	memset(inner, 0x5A, 160);
+	memmove(outer, inner - 128, 128 + 160 + 64);
+	char *forged = outer + 128;
+	heap_free(forged);
+	assert(heap_get_largest_used_block_size() == 400);
+	assert(memcmp(forged, inner, 160) == 0);
+	heap_free(inner);
+	heap_free(inner);
+	char *first = heap_malloc(160);
+	char *second = heap_malloc(160);
+	assert(first != forged && second != forged && first != second);
+	assert(heap_validate() == 0);
+	heap_free(first);
+	heap_free(second);
+	heap_free(outer);
+
+	// MAPPED BLOCKS ARE RESOLVED FROM ANY OF THEIR PAGES
+	char *mapped = heap_malloc((size_t)1 << 20);
+	assert(get_pointer_type(mapped) == pointer_valid);
+	assert(get_pointer_type(mapped - 1) == pointer_inside_fences);
+	assert(get_pointer_type(mapped - 17) == pointer_control_block);
+	assert(get_pointer_type(mapped + 1) == pointer_inside_data_block);
+	assert(get_pointer_type(mapped + 300000) == pointer_inside_data_block);
+	assert(get_pointer_type(mapped + ((size_t)1 << 20) - 1) == pointer_inside_data_block);
+	assert(get_pointer_type(mapped + ((size_t)1 << 20)) == pointer_inside_fences);
+	mapped = heap_realloc(mapped, (size_t)200 << 10);
+	assert(get_pointer_type(mapped + 150000) == pointer_inside_data_block);
+	assert(get_pointer_type(mapped + 300000) == pointer_null);
+	heap_free(mapped);
+	assert(get_pointer_type(mapped + 150000) == pointer_null);
+	heap_clean();
+
+	// POINTERS PAST THE FIRST 64 MIB OF A LARGER HEAP ARE RESOLVED
+	status = custom_sbrk_reserve((size_t)256 << 20);
+	assert(status == 0);
+	status = heap_setup();
+	assert(status == 0);
+	config.mmap_threshold = 0;
+	heap_set_config(&config);
+	block = heap_malloc((size_t)80 << 20);
+	char *far = heap_malloc(1000);
+	assert(block != NULL && far > block + ((size_t)80 << 20));
+	assert(get_pointer_type(far) == pointer_valid);
+	assert(get_pointer_type(far + 500) == pointer_inside_data_block);
+	assert(get_pointer_type(far - 1) == pointer_inside_fences);
+	assert(get_pointer_type(block + ((size_t)70 << 20)) == pointer_inside_data_block);
+	heap_free(far);
+	assert(get_pointer_type(far) == pointer_unallocated);
+	heap_free(block);
+	assert(heap_validate() == 0);
+	config.mmap_threshold = mmap_threshold;
+	heap_set_config(&config);
+
 	heap_clean();
 	return 0;
 }
\ No newline at end of file